@@ -0,0 +1,55 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <vector>
+#include <new>
+#include <stdlib.h>
+#include <type_traits>
+using namespace std;
+
+#define ARENA_BLOCK_OBJECTS 1024  //objects per arena block
+
+//Pool of objects of a single type allocated in fixed size blocks.
+//Objects never move, can be indexed in creation order and are all released at once by Clear.
+template <class T>
+class Arena
+{
+public:
+	Arena(void) : count(0) {}
+	~Arena() { Clear(); }
+
+	T* New(void) { return new (allocate()) T(); }
+	T* New(const T& obj) { return new (allocate()) T(obj); }
+
+	size_t getCount() { return count; }
+	T* get(size_t index) { return blocks[index / ARENA_BLOCK_OBJECTS] + index % ARENA_BLOCK_OBJECTS; }
+
+	void Clear(void)
+	{
+		if (!is_trivially_destructible<T>::value) {
+			for (size_t i = 0; i < count; i++) get(i)->~T();
+		}
+		for (size_t i = 0; i < blocks.size(); i++) free(blocks[i]);
+		blocks.clear();
+		count = 0;
+	}
+
+private:
+	vector<T*> blocks;
+	size_t count;
+
+	Arena(const Arena&);
+	Arena& operator=(const Arena&);
+
+	T* allocate(void)
+	{
+		if (count == blocks.size() * ARENA_BLOCK_OBJECTS) {
+			T* block = (T*)malloc(ARENA_BLOCK_OBJECTS * sizeof(T));
+			if (block == NULL) throw bad_alloc();
+			blocks.push_back(block);
+		}
+		return get(count++);
+	}
+};
+
+#endif
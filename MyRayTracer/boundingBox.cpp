@@ -63,63 +63,25 @@ void AABB::extend(AABB box) {
 
 bool AABB::intercepts(const Ray& ray, float& t)
 {
-	double t0, t1;
-
-	float ox = ray.origin.x;
-	float oy = ray.origin.y;
-	float oz = ray.origin.z;
-	float dx = ray.direction.x;
-	float dy = ray.direction.y;
-	float dz = ray.direction.z;
-
-	float x0 = min.x;
-	float y0 = min.y;
-	float z0 = min.z;
-	float x1 = max.x;
-	float y1 = max.y;
-	float z1 = max.z;
-
-	float tx_min, ty_min, tz_min;
-	float tx_max, ty_max, tz_max;
-
-	float a = 1.0 / dx;
-	if (a >= 0) {
-		tx_min = (x0 - ox) * a;
-		tx_max = (x1 - ox) * a;
-	}
-	else {
-		tx_min = (x1 - ox) * a;
-		tx_max = (x0 - ox) * a;
-	}
-
-	float b = 1.0 / dy;
-	if (b >= 0) {
-		ty_min = (y0 - oy) * b;
-		ty_max = (y1 - oy) * b;
-	}
-	else {
-		ty_min = (y1 - oy) * b;
-		ty_max = (y0 - oy) * b;
-	}
-
-	float c = 1.0 / dz;
-	if (c >= 0) {
-		tz_min = (z0 - oz) * c;
-		tz_max = (z1 - oz) * c;
-	}
-	else {
-		tz_min = (z1 - oz) * c;
-		tz_max = (z0 - oz) * c;
-	}
-
-	//largest entering t value
-	t0 = MAX3(tx_min, ty_min, tz_min);
-
-	//smallest exiting t value
-	t1 = MIN3(tx_max, ty_max, tz_max);
-
-	t = (t0 < 0) ? t1 : t0;
-
-	return (t0 < t1 && t1 > 0);
+	float t0, t1;
+
+	//branchless slab test with the precomputed inverse direction: MIN/MAX order each slab without testing the sign
+	float ax = (min.x - ray.origin.x) * ray.inv_direction.x, bx = (max.x - ray.origin.x) * ray.inv_direction.x;
+	float ay = (min.y - ray.origin.y) * ray.inv_direction.y, by = (max.y - ray.origin.y) * ray.inv_direction.y;
+	float az = (min.z - ray.origin.z) * ray.inv_direction.z, bz = (max.z - ray.origin.z) * ray.inv_direction.z;
+
+	float tx_min = MIN(ax, bx), tx_max = MAX(ax, bx);
+	float ty_min = MIN(ay, by), ty_max = MAX(ay, by);
+	float tz_min = MIN(az, bz), tz_max = MAX(az, bz);
+
+	//largest entering t value, not before the start of the ray interval
+	t0 = MAX(MAX3(tx_min, ty_min, tz_min), ray.tmin);
+
+	//smallest exiting t value, not after the end of the ray interval
+	t1 = MIN(MIN3(tx_max, ty_max, tz_max), ray.tmax);
+
+	t = t0;  //ray.tmin when the origin is inside the box
+
+	return (t0 <= t1);
 }
 #endif
\ No newline at end of file
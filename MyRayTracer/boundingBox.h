@@ -14,7 +14,7 @@ public:
 	AABB operator= (const AABB& rhs);
 	
 	bool isInside(const Vector& p);
-	bool intercepts(const Ray& r, float& t);
+	bool intercepts(const Ray& r, float& t);  //t is the entering distance clipped to [r.tmin, r.tmax]
 	Vector centroid(void);
 	void extend(AABB box);
 
@@ -21,19 +21,31 @@ void BVH::BVHNode::makeNode(unsigned int left_index_) {
 }
 
 
-BVH::BVH(void) {}
+BVH::BVH(void) : arena(NULL), build_area(0.0f) {}
+
+static float surface_area(const AABB& bbox)
+{
+	Vector d = bbox.max - bbox.min;
+	return d.x > 0.0f && d.y > 0.0f && d.z > 0.0f ? 2.0f * (d.x * d.y + d.y * d.z + d.z * d.x) : 0.0f;
+}
+
+BVH::~BVH(void) {
+	for (BVHNode* node : nodes) delete node;
+}
 
 int BVH::getNumObjects() { return objects.size(); }
 
 
-void BVH::Build(vector<Object *> &objs) {
+void BVH::Build(vector<PrimRef> &objs, SceneArena& scene_arena) {
 			BVHNode *root = new BVHNode();
 
+			arena = &scene_arena;
+
 			Vector min = Vector(FLT_MAX, FLT_MAX, FLT_MAX), max = Vector(-FLT_MAX, -FLT_MAX, -FLT_MAX);
 			AABB world_bbox = AABB(min, max);
 
-			for (Object* obj : objs) {
-				AABB bbox = obj->GetBoundingBox();
+			for (PrimRef obj : objs) {
+				AABB bbox = arena->GetBoundingBox(obj);
 				world_bbox.extend(bbox);
 				objects.push_back(obj);
 			}
@@ -43,13 +55,42 @@ void BVH::Build(vector<Object *> &objs) {
 			nodes.push_back(root);
 			//std::cout << "phase 1" << std::endl;
 			build_recursive(0, objects.size(), root); // -> root node takes all the 
+
+			for (BVHNode* node : nodes) build_area += surface_area(node->getAABB());
 		}
 
+//Children come after their parent in nodes, so going backwards every node is updated after its children
+float BVH::Refit(void)
+{
+	float area = 0.0f;
+
+	for (size_t i = nodes.size(); i-- > 0; ) {
+		BVHNode* node = nodes[i];
+		AABB bbox = AABB(Vector(FLT_MAX, FLT_MAX, FLT_MAX), Vector(-FLT_MAX, -FLT_MAX, -FLT_MAX));
+
+		if (node->isLeaf()) {
+			for (unsigned int k = node->getIndex(); k < node->getIndex() + node->getNObjs(); k++)
+				bbox.extend(arena->GetBoundingBox(objects[k]));
+		}
+		else {
+			bbox.extend(nodes[node->getIndex()]->getAABB());
+			bbox.extend(nodes[node->getIndex() + 1]->getAABB());
+		}
+		if (i == 0) {  //padded as in Build
+			bbox.min -= EPSILON;
+			bbox.max += EPSILON;
+		}
+		node->setAABB(bbox);
+		area += surface_area(bbox);
+	}
+	return build_area > 0.0f ? area / build_area : 1.0f;
+}
+
 int BVH::findSplitIndex(int dim, int left_index, int right_index, float split_value) {
 	int split_index = left_index;
 
 	for (int i = left_index; i < right_index; i++) {
-		if (objects[i]->getCentroid().getAxisValue(dim) > split_value) {
+		if (arena->GetBoundingBox(objects[i]).centroid().getAxisValue(dim) > split_value) {
 			// add to left
 			return split_index;
 		}
@@ -68,7 +109,7 @@ int BVH::findMedianSplitIndex(int left_index, int right_index) {
 	return left_index + (int ((float) size / 2.0F + 1.0F));
 }
 
-void BVH::build_recursive(int left_index, int right_index, BVHNode *node) {
+void BVH::build_recursive(int left_index, int right_index, BVHNode *node, int depth) {
 	   //PUT YOUR CODE HERE
 	//std::cout << "left: " << left_index << " right: " << right_index << std::endl;
 	if (right_index - left_index <= Threshold) {
@@ -94,14 +135,15 @@ void BVH::build_recursive(int left_index, int right_index, BVHNode *node) {
 		// sort them for the longest axis
 		Comparator cmp = Comparator();
 		cmp.dimension = dim;
+		cmp.arena = arena;
 		std::sort(objects.begin() + left_index, objects.begin() + right_index, cmp);
 
 		// divide objects
 		float split_value = (aabb.min.getAxisValue(dim) + aabb.max.getAxisValue(dim)) / 2.0F;
 		int split_index = findSplitIndex(dim, left_index, right_index, split_value);
 
-		// check if any empty
-		if (split_index == left_index || split_index == right_index) {
+		// check if any empty, or if the tree is getting too deep for the traversal stack
+		if (split_index == left_index || split_index == right_index || depth >= BVH_MEDIAN_DEPTH) {
 			split_index = findMedianSplitIndex(left_index, right_index);
 			//std::cout << "median: " << split_index << std::endl;
 		}
@@ -113,11 +155,11 @@ void BVH::build_recursive(int left_index, int right_index, BVHNode *node) {
 		AABB left_bbox = AABB(min_left, max_left);
 		AABB right_bbox = AABB(min_right, max_right);
 		for (int i = left_index; i < split_index; i++) {
-			AABB bbox = objects[i]->GetBoundingBox();
+			AABB bbox = arena->GetBoundingBox(objects[i]);
 			left_bbox.extend(bbox);
 		}
 		for (int i = split_index; i < right_index; i++) {
-			AABB bbox = objects[i]->GetBoundingBox();
+			AABB bbox = arena->GetBoundingBox(objects[i]);
 			right_bbox.extend(bbox);
 		}
 
@@ -132,9 +174,9 @@ void BVH::build_recursive(int left_index, int right_index, BVHNode *node) {
 		nodes.push_back(leftNode);
 		nodes.push_back(rightNode);
 
-		build_recursive(left_index, split_index, leftNode);
+		build_recursive(left_index, split_index, leftNode, depth + 1);
 		//std::cout << "left finished finished" << std::endl;
-		build_recursive(split_index, right_index, rightNode);
+		build_recursive(split_index, right_index, rightNode, depth + 1);
 		//std::cout << "right finished finished" << std::endl;
 	}
 
@@ -145,10 +187,11 @@ void BVH::build_recursive(int left_index, int right_index, BVHNode *node) {
 		
 	}
 
-bool BVH::Traverse(Ray& ray, Object** hit_obj, Vector& hit_point) {
+bool BVH::Traverse(Ray& ray, PrimRef& hit_obj, Vector& hit_point) {  //ray.tmax is shrunk to the closest hit found so far
 			float tmp;
-			float tmin = FLT_MAX;  //contains the closest primitive intersection
 			bool hit = false;
+			StackItem hit_stack[BVH_STACK_SIZE];
+			int top = 0;
 
 			BVHNode* currentNode = nodes[0];
 
@@ -166,25 +209,17 @@ bool BVH::Traverse(Ray& ray, Object** hit_obj, Vector& hit_point) {
 					BVHNode* right_node = nodes[currentNode->getIndex() + 1];
 					bool leftHit = left_node->getAABB().intercepts(ray, tl);
 					bool rightHit = right_node->getAABB().intercepts(ray, tr);
-
-					
-					if (left_node->getAABB().isInside(ray.origin)) {
-						tl = 0;
-					}
-					if (right_node->getAABB().isInside(ray.origin)) {
-						tr = 0;
-					}
 					
 
 					if (leftHit && rightHit) {
 						if (tl <= tr) {
 							StackItem item = StackItem(right_node, tr);
-							hit_stack.push(item);
+							hit_stack[top++] = item;
 							currentNode = left_node;
 						}
 						else {
 							StackItem item = StackItem(left_node, tl);
-							hit_stack.push(item);
+							hit_stack[top++] = item;
 							currentNode = right_node;
 						}
 						continue;
@@ -202,21 +237,18 @@ bool BVH::Traverse(Ray& ray, Object** hit_obj, Vector& hit_point) {
 					int index = currentNode->getIndex();
 					int numObjs = currentNode->getNObjs();
 					for (int i = index; i < index + numObjs; i++) {
-						if (objects[i]->intercepts(ray, tmp) && tmp < tmin) {
-							tmin = tmp;
-							*hit_obj = objects[i];
-							//hit_point = ray.origin + ray.direction * tmin;
+						if (arena->intercepts(objects[i], ray, tmp)) {  //only hits closer than ray.tmax are reported
+							ray.tmax = tmp;
+							hit_obj = objects[i];
 							hit = true;
 						}
 					}
 				}
 
 				bool newNode = false;
-				while (!hit_stack.empty()) {
-					StackItem item = hit_stack.top();
-					hit_stack.pop();
-					if (item.t < tmin) {
-						//std::cout << "here " << item.t << " " << tmin << std::endl;
+				while (top > 0) {
+					StackItem item = hit_stack[--top];
+					if (item.t < ray.tmax) {
 						currentNode = item.ptr;
 						newNode = true;
 						break;
@@ -225,9 +257,9 @@ bool BVH::Traverse(Ray& ray, Object** hit_obj, Vector& hit_point) {
 
 				if (newNode) continue;
 				
-				if (hit_stack.empty()) {
+				if (top == 0) {
 					if (hit) {
-						hit_point = ray.origin + ray.direction * tmin;
+						hit_point = ray.origin + ray.direction * ray.tmax;
 					}
 					return hit;
 				}
@@ -236,11 +268,10 @@ bool BVH::Traverse(Ray& ray, Object** hit_obj, Vector& hit_point) {
 			//return hit;
 	}
 
-bool BVH::Traverse(Ray& ray) {  //shadow ray with length
+bool BVH::Traverse(Ray& ray, PrimRef* occluder) {  //shadow ray: normalized direction with ray.tmax set to the distance to the light
 			float tmp;
-
-			double length = ray.direction.length(); //distance between light and intersection point
-			ray.direction.normalize();
+			StackItem hit_stack[BVH_STACK_SIZE];
+			int top = 0;
 
 			bool hit = false;
 			BVHNode* currentNode = nodes[0];
@@ -260,32 +291,24 @@ bool BVH::Traverse(Ray& ray) {  //shadow ray with length
 					bool leftHit = left_node->getAABB().intercepts(ray, tl);
 					bool rightHit = right_node->getAABB().intercepts(ray, tr);
 
-					
-					if (left_node->getAABB().isInside(ray.origin)) {
-						tl = 0;
-					}
-					if (right_node->getAABB().isInside(ray.origin)) {
-						tr = 0;
-					}
-
-					if ((leftHit && tl <= length) && (rightHit && tr <= length)) {
+					if (leftHit && rightHit) {
 						if (tl <= tr) {
 							StackItem item = StackItem(right_node, tr);
-							hit_stack.push(item);
+							hit_stack[top++] = item;
 							currentNode = left_node;
 						}
 						else {
 							StackItem item = StackItem(left_node, tl);
-							hit_stack.push(item);
+							hit_stack[top++] = item;
 							currentNode = right_node;
 						}
 						continue;
 					}
-					else if (leftHit && tl <= length) {
+					else if (leftHit) {
 						currentNode = left_node;
 						continue;
 					}
-					else if (rightHit && tr <= length) {
+					else if (rightHit) {
 						currentNode = right_node;
 						continue;
 					}
@@ -294,17 +317,17 @@ bool BVH::Traverse(Ray& ray) {  //shadow ray with length
 					int index = currentNode->getIndex();
 					int numObjs = currentNode->getNObjs();
 					for (int i = index; i < index + numObjs; i++) {
-						if (objects[i]->intercepts(ray, tmp) && tmp <= length) {
+						if (arena->intercepts(objects[i], ray, tmp)) {
+							if (occluder != NULL) *occluder = objects[i];
 							return true;
 						}
 					}
 				}
 
 				bool newNode = false;
-				while (!hit_stack.empty()) {
-					StackItem item = hit_stack.top();
-					hit_stack.pop();
-					if (item.t <= length) {
+				while (top > 0) {
+					StackItem item = hit_stack[--top];
+					if (item.t <= ray.tmax) {
 						currentNode = item.ptr;
 						newNode = true;
 						break;
@@ -313,7 +336,7 @@ bool BVH::Traverse(Ray& ray) {  //shadow ray with length
 
 				if (newNode) continue;
 
-				if (hit_stack.empty()) {
+				if (top == 0) {
 					return false;
 				}
 			}
@@ -27,6 +27,7 @@ public:
 	float GetPlaneDist() { return plane_dist; }
 	float GetFar() {return vfar; }
 	float GetAperture() { return aperture; }
+	float GetPixelAngle() { return h / (res_y * plane_dist); }  //angle a pixel subtends at the centre of the view
 
     Camera( Vector from, Vector At, Vector Up, float angle, float hither, float yon, int ResX, int ResY, float Aperture_ratio, float Focal_ratio) {
 	    eye = from;
@@ -82,7 +83,21 @@ public:
 
 		ray_dir = (u * rdx + v * rdy + n * rdz).normalize();
 
-		return Ray(eye, ray_dir);
+		Ray ray(eye, ray_dir);
+		ray.spread = GetPixelAngle();
+		return ray;
+	}
+
+	bool Project(const Vector& point, float& x, float& y) // Inverse of PrimaryRay(pixel_sample): viewport coordinates of a point in front of the eye
+	{
+		Vector d = point - eye;
+		float dz = d * n;
+		if (dz >= 0.0f) return false;  //behind the eye (n points backwards)
+
+		float s = plane_dist / -dz;
+		x = ((d * u) * s / w + 0.5f) * res_x;
+		y = ((d * v) * s / h + 0.5f) * res_y;
+		return true;
 	}
 
 	Ray PrimaryRay(const Vector& lens_sample, const Vector& pixel_sample) // DOF: Rays cast from  a thin lens sample to a pixel sample
@@ -109,7 +124,9 @@ public:
 
 		Vector eye_offset = eye + (u * l_s.x) + (v * l_s.y);
 
-		return Ray(eye_offset, ray_dir);
+		Ray ray(eye_offset, ray_dir);
+		ray.spread = GetPixelAngle();
+		return ray;
 	}
 };
 
@@ -6,64 +6,75 @@
 #include <cfloat>
 using namespace std;
 
+#include "vecmath.h"
+
 #define CLAMP(a, b, c)		(((b) < (a)) ? (a) : (((b) > (c)) ? (c) : (b)))
 
 class Color
 {
 private:
 
- float R, G, B;
+ float3 RGB;
 
 public:
-		Color		()
-		     		: R(0.0), G(0.0), B(0.0)
+  constexpr	Color		()
+		     		: RGB(0.0f, 0.0f, 0.0f)
 		     		{}
-		Color		(float r, float g, float b)
-				: R(r), G(g), B(b)
+  constexpr	Color		(float r, float g, float b)
+				: RGB(r, g, b)
+				{}
+  constexpr explicit	Color	(const float3& rgb)
+				: RGB(rgb)
 				{}
 
-  float        r		() const
-	          		{ return R; }
+  constexpr float	r		() const
+	          		{ return RGB.x; }
   float        r		(float r)
-	          		{ return (R = r); }
-  float        g		() const
-	          		{ return G; }
+	          		{ return (RGB.x = r); }
+  constexpr float	g		() const
+	          		{ return RGB.y; }
   float        g		(float g)
-	          		{ return (G = g); }
-  float        b		() const
-	          		{ return B; }
+	          		{ return (RGB.y = g); }
+  constexpr float	b		() const
+	          		{ return RGB.z; }
   float        b		(float b)
-	          		{ return (B = b); }
+	          		{ return (RGB.z = b); }
+  constexpr const float3&	rgb	() const
+				{ return RGB; }
 
-  Color 	clamp		() const
+  constexpr Color 	clamp		() const
         			{
-        			   return Color(CLAMP(0.0, R, 1.0),
-        					CLAMP(0.0, G, 1.0),
-        					CLAMP(0.0, B, 1.0));
+        			   return Color(CLAMP(0.0f, RGB.x, 1.0f),
+        					CLAMP(0.0f, RGB.y, 1.0f),
+        					CLAMP(0.0f, RGB.z, 1.0f));
         			}
 
 
-  Color 	operator *	(float c) 
-        			{ return Color(R*c, G*c, B*c); }
+  constexpr float	luminance	() const	//Rec. 709 weights of the linear components
+				{ return 0.2126f * RGB.x + 0.7152f * RGB.y + 0.0722f * RGB.z; }
+
+
+  constexpr Color 	operator *	(float c) const
+        			{ return Color(RGB * c); }
 
 
-  Color		operator *=	(float c)
-        			{ R*=c; G*=c; B*=c; return *this; }
+  Color&	operator *=	(float c)
+        			{ RGB *= c; return *this; }
 
-  Color 	operator +	( Color c) 
-        			{ return Color(R+c.R, G+c.G, B+c.B); }
-  Color 	operator *	(Color c) 
-        			{ return Color(R*c.R, G*c.G, B*c.B); }
+  constexpr Color 	operator +	(const Color& c) const
+        			{ return Color(RGB + c.RGB); }
+  constexpr Color 	operator *	(const Color& c) const
+        			{ return Color(mul(RGB, c.RGB)); }
 
-  Color		operator +=	( Color c)
-        			{ R+=c.R; G+=c.G; B+=c.B; return *this; }
-  Color		operator *=	(Color c)
-				{ R*=c.R; G*=c.G; B*=c.B; return *this; }
+  Color&	operator +=	(const Color& c)
+        			{ RGB += c.RGB; return *this; }
+  Color&	operator *=	(const Color& c)
+				{ RGB = mul(RGB, c.RGB); return *this; }
 
    friend inline
   istream&	operator >>	(istream& s, Color& c)
-	{ return s >> c.R >> c.G >> c.B; }
+	{ return s >> c.RGB.x >> c.RGB.y >> c.RGB.z; }
 };
 
 
-#endif
\ No newline at end of file
+#endif
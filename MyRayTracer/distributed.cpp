@@ -0,0 +1,351 @@
+#ifdef _WIN32
+#define NOMINMAX
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#pragma comment(lib, "Ws2_32.lib")
+#define close_socket closesocket
+#else
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <unistd.h>
+#define INVALID_SOCKET (-1)
+#define close_socket close
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#include <map>
+
+#include "distributed.h"
+#include "macros.h"
+
+#ifdef MSG_NOSIGNAL
+#define SEND_FLAGS MSG_NOSIGNAL	//a worker gone while sending to it is an error, not a SIGPIPE
+#else
+#define SEND_FLAGS 0
+#endif
+
+//Every message is its type and the size of its payload, followed by the payload
+typedef enum { MSG_SCENE = 1, MSG_TILE, MSG_PIXELS } MessageType;	//scene file name, TileJob, frame + tile + pixels
+
+//Largest payloads accepted, so that a bad header cannot make the receiver allocate gigabytes
+#define MAX_PIXELS_PAYLOAD (2 * sizeof(uint32_t) + 3 * sizeof(float) * DIST_TILE_SIZE * DIST_TILE_SIZE)
+#define MAX_SCENE_NAME 4096
+
+static bool net_init(void)
+{
+#ifdef _WIN32
+	static bool started = false;
+	WSADATA data;
+	if (!started) started = WSAStartup(MAKEWORD(2, 2), &data) == 0;
+	return started;
+#else
+	return true;
+#endif
+}
+
+static bool send_all(socket_t sock, const void* data, size_t size)
+{
+	const char* p = (const char*)data;
+	while (size > 0) {
+		int n = send(sock, p, (int)MIN(size, (size_t)1 << 20), SEND_FLAGS);
+		if (n <= 0) return false;
+		p += n;
+		size -= n;
+	}
+	return true;
+}
+
+static bool recv_all(socket_t sock, void* data, size_t size)
+{
+	char* p = (char*)data;
+	while (size > 0) {
+		int n = recv(sock, p, (int)MIN(size, (size_t)1 << 20), 0);
+		if (n <= 0) return false;
+		p += n;
+		size -= n;
+	}
+	return true;
+}
+
+static bool send_message(socket_t sock, uint32_t type, const void* data, size_t size, const void* data2 = NULL, size_t size2 = 0)
+{
+	uint32_t header[2] = { type, (uint32_t)(size + size2) };
+	return send_all(sock, header, sizeof(header)) && send_all(sock, data, size) && (size2 == 0 || send_all(sock, data2, size2));
+}
+
+static bool recv_message(socket_t sock, uint32_t& type, vector<uint8_t>& payload, size_t max_size)
+{
+	uint32_t header[2];
+	if (!recv_all(sock, header, sizeof(header)) || header[1] > max_size) return false;
+	type = header[0];
+	payload.resize(header[1]);
+	return header[1] == 0 || recv_all(sock, &payload[0], header[1]);
+}
+
+// --------------------------------------------------------------------- coordinator
+Coordinator::Coordinator(void) : listener(INVALID_SOCKET), frame(0) {}
+
+Coordinator::~Coordinator()
+{
+	for (size_t w = 0; w < workers.size(); w++) close_socket(workers[w].sock);
+	if (listener != INVALID_SOCKET) close_socket(listener);
+}
+
+bool Coordinator::Listen(int port)
+{
+	if (!net_init()) return false;
+
+	listener = socket(AF_INET, SOCK_STREAM, 0);
+	if (listener == INVALID_SOCKET) return false;
+
+	int yes = 1;
+	setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, (const char*)&yes, sizeof(yes));
+
+	sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	addr.sin_port = htons((unsigned short)port);
+	if (::bind(listener, (sockaddr*)&addr, sizeof(addr)) != 0 || listen(listener, 16) != 0) {
+		close_socket(listener);
+		listener = INVALID_SOCKET;
+		return false;
+	}
+	printf("Coordinator listening on port %d\n", port);
+	return true;
+}
+
+void Coordinator::Accept(void)
+{
+	Worker worker;
+	worker.sock = accept(listener, NULL, NULL);
+	if (worker.sock == INVALID_SOCKET) return;
+
+	int yes = 1;
+	setsockopt(worker.sock, IPPROTO_TCP, TCP_NODELAY, (const char*)&yes, sizeof(yes));  //tiles are sent as soon as asked
+
+	//reads only start once select finds data, so a worker that stalls in the middle of a message makes them fail
+	//instead of blocking the coordinator, and the worker is dropped
+#ifdef _WIN32
+	DWORD timeout = DIST_RECV_TIMEOUT * 1000;
+#else
+	timeval timeout = { DIST_RECV_TIMEOUT, 0 };
+#endif
+	setsockopt(worker.sock, SOL_SOCKET, SO_RCVTIMEO, (const char*)&timeout, sizeof(timeout));
+	worker.tile = -1;
+	worker.frame = 0;
+	worker.copied = false;
+	workers.push_back(worker);
+	printf("Worker connected (%d)\n", (int)workers.size());
+}
+
+void Coordinator::Drop(size_t w, vector<int>& pending)
+{
+	if (workers[w].tile >= 0 && workers[w].frame == frame) pending.push_back(workers[w].tile);
+	close_socket(workers[w].sock);
+	workers.erase(workers.begin() + w);
+	printf("Worker lost, its tile is given to the others (%d left)\n", (int)workers.size());
+}
+
+bool Coordinator::Render(const char* scene_file, const Vector& eye, const TileJob& settings, const ImageRegion& region, ImageWriter& writer)
+{
+	int res_x = region.Width(), res_y = region.Height();	//tiles and rows are counted in the region
+	int tiles_x = (res_x + DIST_TILE_SIZE - 1) / DIST_TILE_SIZE;
+	int tiles_y = (res_y + DIST_TILE_SIZE - 1) / DIST_TILE_SIZE;
+	bool top_down = writer.IsTopDown();
+	vector<int> pending;	//tiles left, the next one at the back
+	vector<int> band_tiles(tiles_y, 0);	//tiles received per row of tiles
+	vector<bool> received(tiles_x * tiles_y, false);
+	map<int, vector<float> > bands;	//rows of tiles received but not written yet
+	bool waiting = false;
+
+	frame++;
+
+	//the rows of tiles the file needs first go out first; the ones written by a resumed render are skipped
+	for (int i = 0; i < tiles_y; i++) {
+		int band = top_down ? i : tiles_y - 1 - i;
+		int y0 = band * DIST_TILE_SIZE, y1 = MIN(y0 + DIST_TILE_SIZE, res_y);
+		if (top_down ? y0 >= res_y - writer.GetRowsDone() : y1 <= writer.GetRowsDone()) continue;
+		for (int tx = tiles_x - 1; tx >= 0; tx--) pending.push_back(band * tiles_x + tx);
+	}
+
+	while (!writer.Done()) {
+		//one tile at a time per idle worker, with the scene first if it has another one loaded
+		for (size_t w = 0; w < workers.size() && !pending.empty(); w++) {
+			if (workers[w].tile >= 0) continue;
+
+			int tile = pending.back();
+			if (received[tile]) {	//a copy of a late tile, whose first worker finished it after all
+				pending.pop_back();
+				w--;
+				continue;
+			}
+			TileJob job = settings;
+			job.frame = frame;
+			job.tile = tile;
+			job.x0 = (tile % tiles_x) * DIST_TILE_SIZE;
+			job.y0 = (tile / tiles_x) * DIST_TILE_SIZE;
+			job.x1 = region.x0 + MIN(job.x0 + DIST_TILE_SIZE, res_x);
+			job.y1 = region.y0 + MIN(job.y0 + DIST_TILE_SIZE, res_y);
+			job.x0 += region.x0;
+			job.y0 += region.y0;
+			job.eye[0] = eye.x; job.eye[1] = eye.y; job.eye[2] = eye.z;
+
+			bool sent = workers[w].scene == scene_file || send_message(workers[w].sock, MSG_SCENE, scene_file, strlen(scene_file));
+			if (!sent || !send_message(workers[w].sock, MSG_TILE, &job, sizeof(job))) {
+				Drop(w--, pending);
+				continue;
+			}
+			pending.pop_back();
+			workers[w].scene = scene_file;
+			workers[w].tile = tile;
+			workers[w].frame = frame;
+			workers[w].copied = false;
+			workers[w].start = chrono::steady_clock::now();
+		}
+
+		if (workers.empty() && !waiting) printf("Waiting for workers...\n");
+		waiting = workers.empty();
+
+		fd_set readable;
+		FD_ZERO(&readable);
+		FD_SET(listener, &readable);
+		socket_t top = listener;
+		for (size_t w = 0; w < workers.size(); w++) {
+			FD_SET(workers[w].sock, &readable);
+			top = MAX(top, workers[w].sock);
+		}
+		timeval timeout = { 1, 0 };
+		if (select((int)top + 1, &readable, NULL, NULL, &timeout) < 0) return false;
+
+		for (size_t w = 0; w < workers.size(); w++) {
+			Worker& worker = workers[w];
+
+			//a slow worker keeps its connection and its tile, and another one gets a copy of the tile
+			if (!FD_ISSET(worker.sock, &readable)) {
+				if (worker.tile >= 0 && worker.frame == frame && !worker.copied && !received[worker.tile] &&
+					chrono::steady_clock::now() - worker.start > chrono::seconds(DIST_TILE_TIMEOUT)) {
+					pending.push_back(worker.tile);
+					worker.copied = true;
+					printf("Worker late with tile %d, a copy of it is given to the others\n", worker.tile);
+				}
+				continue;
+			}
+
+			uint32_t type;
+			vector<uint8_t> payload;
+			if (!recv_message(worker.sock, type, payload, MAX_PIXELS_PAYLOAD) || type != MSG_PIXELS || payload.size() < 2 * sizeof(uint32_t)) {
+				Drop(w--, pending);
+				continue;
+			}
+
+			uint32_t ids[2];	//frame and tile
+			memcpy(ids, &payload[0], sizeof(ids));
+			if (ids[0] != worker.frame || (int)ids[1] != worker.tile) {	//not the reply to the tile it was given
+				Drop(w--, pending);
+				continue;
+			}
+
+			//the tile of an earlier frame, or one another worker sent first, is only the worker becoming idle
+			int tile = worker.tile;
+			if (ids[0] == frame && !received[tile]) {
+				int band = tile / tiles_x;
+				int x0 = (tile % tiles_x) * DIST_TILE_SIZE, x1 = MIN(x0 + DIST_TILE_SIZE, res_x);
+				int y0 = band * DIST_TILE_SIZE, y1 = MIN(y0 + DIST_TILE_SIZE, res_y);
+				size_t row_size = 3 * sizeof(float) * (x1 - x0);
+				if (payload.size() != sizeof(ids) + row_size * (y1 - y0)) {
+					Drop(w--, pending);
+					continue;
+				}
+
+				vector<float>& pixels = bands[band];
+				pixels.resize(3 * (size_t)res_x * (y1 - y0));
+				for (int y = y0; y < y1; y++)
+					memcpy(&pixels[3 * ((size_t)(y - y0) * res_x + x0)], &payload[sizeof(ids) + row_size * (y - y0)], row_size);
+				band_tiles[band]++;
+				received[tile] = true;
+			}
+			worker.tile = -1;
+		}
+
+		if (FD_ISSET(listener, &readable)) Accept();
+
+		//rows go to the file as soon as their row of tiles is complete
+		while (!writer.Done()) {
+			int y = writer.GetNextRow(), band = y / DIST_TILE_SIZE;
+			if (band_tiles[band] < tiles_x) break;
+
+			vector<Color> row(res_x);
+			float* pixel = &bands[band][3 * (size_t)(y - band * DIST_TILE_SIZE) * res_x];
+			for (int x = 0; x < res_x; x++, pixel += 3) row[x] = Color(pixel[0], pixel[1], pixel[2]);
+			if (!writer.WriteRow(&row[0])) return false;
+
+			int next = writer.Done() ? -1 : writer.GetNextRow() / DIST_TILE_SIZE;
+			if (next != band) bands.erase(band);
+		}
+	}
+	return true;
+}
+
+// --------------------------------------------------------------------- worker
+bool runWorker(const char* address, SceneLoader load, RegionRenderer render)
+{
+	char host[256];
+	const char* colon = strrchr(address, ':');
+	if (colon == NULL || colon - address >= (int)sizeof(host) || !net_init()) return false;
+	memcpy(host, address, colon - address);
+	host[colon - address] = '\0';
+
+	addrinfo hints, *result;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(host, colon + 1, &hints, &result) != 0) return false;
+
+	socket_t sock = socket(result->ai_family, result->ai_socktype, result->ai_protocol);
+	bool connected = sock != INVALID_SOCKET && connect(sock, result->ai_addr, (int)result->ai_addrlen) == 0;
+	freeaddrinfo(result);
+	if (!connected) {
+		if (sock != INVALID_SOCKET) close_socket(sock);
+		return false;
+	}
+	int yes = 1;
+	setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (const char*)&yes, sizeof(yes));
+	printf("Connected to the coordinator at %s\n", address);
+
+	string scene;
+	uint32_t type;
+	vector<uint8_t> payload;
+	vector<float> pixels;
+	int tiles = 0;
+
+	while (recv_message(sock, type, payload, MAX(sizeof(TileJob), (size_t)MAX_SCENE_NAME))) {
+		if (type == MSG_SCENE) {
+			string name(payload.begin(), payload.end());
+			if (name != scene) {	//the same scene stays loaded from one frame to the next
+				if (!load(name.c_str())) break;
+				scene = name;
+			}
+		}
+		else if (type == MSG_TILE && payload.size() == sizeof(TileJob)) {
+			TileJob job;
+			memcpy(&job, &payload[0], sizeof(job));
+			pixels.resize(3 * (size_t)(job.x1 - job.x0) * (job.y1 - job.y0));
+			render(job, &pixels[0]);
+
+			uint32_t ids[2] = { job.frame, job.tile };
+			if (!send_message(sock, MSG_PIXELS, ids, sizeof(ids), &pixels[0], pixels.size() * sizeof(float))) break;
+			tiles++;
+		}
+		else break;
+	}
+
+	close_socket(sock);
+	printf("Coordinator closed the connection after %d tiles\n", tiles);
+	return true;
+}
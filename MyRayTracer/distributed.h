@@ -0,0 +1,85 @@
+#ifndef DISTRIBUTED_H
+#define DISTRIBUTED_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <chrono>
+using namespace std;
+
+#include "vector.h"
+#include "imageWriter.h"
+
+#define DIST_TILE_SIZE 64		//tiles handed to the workers are DIST_TILE_SIZE x DIST_TILE_SIZE pixels
+#define DIST_TILE_TIMEOUT 60	//seconds a worker may take for a tile before a copy of it is given to another one
+#define DIST_RECV_TIMEOUT 10	//seconds a message of a worker may take to arrive once it has started
+
+//Rendering of the file mode split across worker processes connected by TCP (several may run on the same host).
+//The coordinator hands out one tile at a time to each worker and writes the rows of the image as their tiles come back;
+//the tiles of a worker that disconnects go to the others, and a copy of a late tile is given to another worker, the
+//first result to come back being kept. A worker loads a scene once and keeps it, with its accelerator, for every tile
+//and frame of that scene. Both ends must have the same byte order.
+
+//Region of the image a worker renders: pixels x0 <= x < x1, y0 <= y < y1 (viewport coordinates) seen from eye, with
+//spp x spp samples per pixel (0 for one ray through the center) and the ray termination and light sampling settings of
+//the coordinator
+struct TileJob
+{
+	unsigned int frame;
+	unsigned int tile;
+	int x0, y0, x1, y1;
+	float eye[3];
+	int spp;
+	int max_depth;
+	float min_weight;
+	int roulette;
+	int light_samples;
+	int env_samples;
+	float time;		//of the poses of the animated instances
+};
+
+//What the worker needs from the renderer: loading a scene file, and rendering a region of it as linear RGB floats,
+//row after row from y0
+typedef bool (*SceneLoader)(const char* scene_file);
+typedef void (*RegionRenderer)(const TileJob& job, float* pixels);
+
+#ifdef _WIN32
+typedef uintptr_t socket_t;	//SOCKET, without pulling winsock2.h into every file
+#else
+typedef int socket_t;
+#endif
+
+class Coordinator
+{
+public:
+	Coordinator(void);
+	~Coordinator();
+
+	bool Listen(int port);
+	//Renders a region of a frame of the scene with the workers that are or get connected, and streams it to the writer
+	//opened for the size of the region; the render settings of the tiles come from settings. False if the image cannot
+	//be written.
+	bool Render(const char* scene_file, const Vector& eye, const TileJob& settings, const ImageRegion& region, ImageWriter& writer);
+
+private:
+	struct Worker {
+		socket_t sock;
+		string scene;		//scene file the worker has loaded
+		int tile;			//tile it is rendering, -1 if idle
+		unsigned int frame;	//of that tile
+		bool copied;		//the tile was also given to another worker for being late
+		chrono::steady_clock::time_point start;
+	};
+
+	void Accept(void);
+	void Drop(size_t w, vector<int>& pending);	//closes the connection and gives its tile back
+
+	socket_t listener;
+	vector<Worker> workers;
+	unsigned int frame;
+};
+
+//Connects to the coordinator at host:port and renders the tiles it sends until it closes the connection
+bool runWorker(const char* address, SceneLoader load, RegionRenderer render);
+
+#endif
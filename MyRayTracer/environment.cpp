@@ -0,0 +1,193 @@
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <cstdint>
+
+#include "environment.h"
+#include "maths.h"
+#include "macros.h"
+
+bool EnvironmentMap::Load(const char* filename)
+{
+	const char* ext = strrchr(filename, '.');
+	bool pfm = ext != NULL && (strcmp(ext, ".pfm") == 0 || strcmp(ext, ".PFM") == 0);
+	FILE* file = fopen(filename, "rb");
+	if (file == NULL) {
+		printf("Error opening environment map %s\n", filename);
+		return false;
+	}
+
+	bool loaded = pfm ? LoadPFM(file) : LoadHDR(file);
+	fclose(file);
+	if (!loaded) {
+		printf("Error reading environment map %s\n", filename);
+		width = height = 0;
+		return false;
+	}
+
+	BuildDistribution();
+	printf("Environment map %s: %dx%d\n", filename, width, height);
+	return true;
+}
+
+//Radiance RGBE: a header of text lines up to an empty one, the resolution line, and the scanlines from the top, each
+//either run length encoded per channel or as plain RGBE texels
+bool EnvironmentMap::LoadHDR(FILE* file)
+{
+	char line[256];
+
+	if (fgets(line, sizeof(line), file) == NULL || strncmp(line, "#?", 2) != 0) return false;
+	while (fgets(line, sizeof(line), file) != NULL && line[0] != '\n') {
+		if (strncmp(line, "FORMAT=", 7) == 0 && strncmp(line + 7, "32-bit_rle_rgbe", 15) != 0) return false;  //not XYZE
+	}
+	if (fgets(line, sizeof(line), file) == NULL || sscanf(line, "-Y %d +X %d", &height, &width) != 2) return false;
+	if (width <= 0 || height <= 0) return false;
+
+	vector<uint8_t> rgbe(4 * width);
+	texels.resize(3 * (size_t)width * height);
+	for (int y = 0; y < height; y++) {
+		int c0 = getc(file), c1 = getc(file), c2 = getc(file), c3 = getc(file);
+		if (c3 == EOF) return false;
+
+		if (c0 == 2 && c1 == 2 && (c2 << 8 | c3) == width && width >= 8 && width < 32768) {
+			for (int c = 0; c < 4; c++) {  //the runs of each channel in turn
+				for (int x = 0; x < width; ) {
+					int count = getc(file);
+					if (count == EOF) return false;
+					if (count > 128) {
+						count -= 128;
+						int value = getc(file);
+						if (value == EOF || x + count > width) return false;
+						for (int k = 0; k < count; k++) rgbe[4 * x++ + c] = (uint8_t)value;
+					}
+					else {
+						if (count == 0 || x + count > width) return false;
+						for (int k = 0; k < count; k++) {
+							int value = getc(file);
+							if (value == EOF) return false;
+							rgbe[4 * x++ + c] = (uint8_t)value;
+						}
+					}
+				}
+			}
+		}
+		else {
+			rgbe[0] = (uint8_t)c0; rgbe[1] = (uint8_t)c1; rgbe[2] = (uint8_t)c2; rgbe[3] = (uint8_t)c3;
+			if (fread(&rgbe[4], 4, width - 1, file) != (size_t)(width - 1)) return false;
+		}
+
+		float* row = &texels[3 * (size_t)y * width];
+		for (int x = 0; x < width; x++) {
+			float f = rgbe[4 * x + 3] != 0 ? ldexpf(1.0f, rgbe[4 * x + 3] - (128 + 8)) : 0.0f;
+			for (int c = 0; c < 3; c++) row[3 * x + c] = rgbe[4 * x + c] * f;
+		}
+	}
+	return true;
+}
+
+//PFM: "PF", the resolution and a scale whose sign gives the byte order, then RGB floats with the rows from the bottom
+bool EnvironmentMap::LoadPFM(FILE* file)
+{
+	char magic[3];
+	float scale;
+
+	if (fscanf(file, "%2s %d %d %f", magic, &width, &height, &scale) != 4 || strcmp(magic, "PF") != 0) return false;
+	if (width <= 0 || height <= 0 || fgetc(file) == EOF) return false;  //the single white space ending the header
+
+	uint16_t probe = 1;
+	bool swap = (scale < 0.0f) != (*(uint8_t*)&probe == 1);
+	texels.resize(3 * (size_t)width * height);
+	for (int y = height - 1; y >= 0; y--) {
+		float* row = &texels[3 * (size_t)y * width];
+		if (fread(row, 3 * sizeof(float), width, file) != (size_t)width) return false;
+		if (swap) {
+			for (int i = 0; i < 3 * width; i++) {
+				uint8_t* b = (uint8_t*)&row[i];
+				std::swap(b[0], b[3]);
+				std::swap(b[1], b[2]);
+			}
+		}
+	}
+	return true;
+}
+
+float EnvironmentMap::RowWeight(int y) const
+{
+	return sinf(PI * (y + 0.5f) / height);
+}
+
+void EnvironmentMap::BuildDistribution()
+{
+	vector<double> sums(width + 1);
+
+	row_cdf.assign(height + 1, 0.0f);
+	col_cdf.assign((size_t)height * (width + 1), 0.0f);
+	total = 0.0;
+	for (int y = 0; y < height; y++) {
+		float weight = RowWeight(y);
+		float* cdf = &col_cdf[(size_t)y * (width + 1)];
+
+		sums[0] = 0.0;
+		for (int x = 0; x < width; x++)
+			sums[x + 1] = sums[x] + MAX(Texel(x, y).luminance(), 0.0f) * weight;
+		for (int x = 1; x < width; x++)  //a black row is never picked, any CDF does
+			cdf[x] = sums[width] > 0.0 ? (float)(sums[x] / sums[width]) : (float)x / width;
+		cdf[width] = 1.0f;
+
+		total += sums[width];
+		row_cdf[y + 1] = (float)total;  //normalized once the total is known
+	}
+	for (int y = 1; y < height; y++) row_cdf[y] = total > 0.0 ? (float)(row_cdf[y] / total) : (float)y / height;
+	row_cdf[height] = 1.0f;
+}
+
+//Direction (x, y, z) at the polar angle theta from +Y and the azimuth phi from -Z toward +X maps to
+//u = (phi + PI) / 2PI and v = theta / PI
+Color EnvironmentMap::Lookup(const Vector& direction) const
+{
+	Vector d = direction;
+	d.normalize();
+	float u = (atan2f(d.x, -d.z) + PI) / (2.0f * PI);
+	float v = acosf(CLAMP(-1.0f, d.y, 1.0f)) / PI;
+
+	float x = u * width - 0.5f;
+	float y = v * height - 0.5f;
+	float fx = x - floorf(x);
+	float fy = y - floorf(y);
+	int x0 = (int)floorf(x), y0 = (int)floorf(y);
+	int x1 = x0 + 1, y1 = MIN(y0 + 1, height - 1);
+	x0 = (x0 + width) % width;  //around the Y axis the map wraps, at the poles it is clamped
+	x1 = x1 % width;
+	y0 = MAX(y0, 0);
+
+	return (Texel(x0, y0) * (1.0f - fx) + Texel(x1, y0) * fx) * (1.0f - fy) +
+		(Texel(x0, y1) * (1.0f - fx) + Texel(x1, y1) * fx) * fy;
+}
+
+Color EnvironmentMap::Sample(float u1, float u2, Vector& direction, float& pdf) const
+{
+	pdf = 0.0f;
+	if (total <= 0.0) return Color();
+
+	//the texel, by the CDF of the rows and then by the one of its row, and a uniform point in it
+	int y = (int)(upper_bound(row_cdf.begin(), row_cdf.end(), u1) - row_cdf.begin()) - 1;
+	y = CLAMP(0, y, height - 1);
+	float dv = (u1 - row_cdf[y]) / (row_cdf[y + 1] - row_cdf[y]);
+
+	const float* cdf = &col_cdf[(size_t)y * (width + 1)];
+	int x = (int)(upper_bound(cdf, cdf + width + 1, u2) - cdf) - 1;
+	x = CLAMP(0, x, width - 1);
+	float du = (u2 - cdf[x]) / (cdf[x + 1] - cdf[x]);
+
+	float theta = PI * (y + dv) / height;
+	float phi = 2.0f * PI * (x + du) / width - PI;
+	float sin_theta = sinf(theta);
+	if (sin_theta <= 0.0f) return Color();
+	direction = Vector(sin_theta * sinf(phi), cosf(theta), -sin_theta * cosf(phi));
+
+	//the density over the image, of the texel relative to the mean, over the solid angle of the image at the point
+	Color radiance = Texel(x, y);
+	float density = (float)(MAX(radiance.luminance(), 0.0f) * RowWeight(y) * width * height / total);
+	pdf = density / (2.0f * PI * PI * sin_theta);
+	return radiance;
+}
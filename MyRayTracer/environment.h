@@ -0,0 +1,45 @@
+#ifndef ENVIRONMENT_H
+#define ENVIRONMENT_H
+
+#include <cstdio>
+#include <vector>
+using namespace std;
+
+#include "vector.h"
+#include "color.h"
+
+//Radiance arriving from the surroundings of a scene, in an equirectangular HDR image: its columns go once around the
+//Y axis starting behind -Z, and its rows from +Y at the top down to -Y. To light a point from it, directions are drawn
+//in proportion to the radiance of the texels times the solid angle they cover, by a piecewise constant 2D distribution:
+//the CDF of the rows, and the CDF of the texels of each row.
+class EnvironmentMap
+{
+public:
+	EnvironmentMap() : width(0), height(0), total(0.0) {}
+
+	bool Load(const char* filename);	//Radiance RGBE (.hdr) or float (.pfm) image
+	bool IsLoaded() const { return width > 0; }
+	int GetWidth() const { return width; }
+	int GetHeight() const { return height; }
+
+	Color Lookup(const Vector& direction) const;	//bilinear
+
+	//Direction drawn by the uniform random numbers u1 and u2, with its radiance and its pdf over the solid angle; pdf 0
+	//if the map is black
+	Color Sample(float u1, float u2, Vector& direction, float& pdf) const;
+
+private:
+	bool LoadHDR(FILE* file);
+	bool LoadPFM(FILE* file);
+	void BuildDistribution();
+	float RowWeight(int y) const;	//solid angle of the texels of row y, relative to those of the equator
+	Color Texel(int x, int y) const { const float* t = &texels[3 * (y * width + x)]; return Color(t[0], t[1], t[2]); }
+
+	int width, height;
+	vector<float> texels;	//RGB, rows from the top
+	vector<float> row_cdf;	//height + 1 values from 0 to 1
+	vector<float> col_cdf;	//width + 1 values from 0 to 1 per row
+	double total;			//sum over the texels of their luminance times the weight of their row
+};
+
+#endif
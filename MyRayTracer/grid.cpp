@@ -2,7 +2,7 @@
 #include "macros.h"
 
 
-Grid::Grid(void) {}
+Grid::Grid(void) : arena(NULL) {}
 
 int Grid::getNumObjects()
 {
@@ -13,21 +13,19 @@ int Grid::getNumObjects()
 void Grid::setAABB(AABB& bbox_) { this->bbox = bbox_; }
 
 
-void Grid::addObject(Object* o)
+void Grid::addObject(PrimRef p)
 {
-	objects.push_back(o);
+	objects.push_back(p);
 }
 
 
-Object* Grid::getObject(unsigned int index)
+PrimRef Grid::getObject(unsigned int index)
 {
-	if (index >= 0 && index < objects.size())
-		return objects[index];
-	return NULL;
+	return objects[index];
 }
 
 // ---------------------------------------------setup_cells
-void Grid::Build(vector<Object*>& objs) {
+void Grid::Build(vector<PrimRef>& objs, SceneArena& scene_arena) {
 
 	int xmin, xmax;
 	int ymin, ymax;
@@ -39,9 +37,17 @@ void Grid::Build(vector<Object*>& objs) {
 
 	AABB grid_bbox = AABB(min, max);
 
+	arena = &scene_arena;
+
+	if (objs.empty()) {  //only unbounded primitives in the scene: a single empty cell
+		nx = ny = nz = 1;
+		cells.resize(1);
+		return;
+	}
+
 	//build the Grid BB and //insert scene objects in the Grid objects list
-	for (Object* obj : objs) {
-		AABB o_bbox = obj->GetBoundingBox();
+	for (PrimRef obj : objs) {
+		AABB o_bbox = arena->GetBoundingBox(obj);
 		grid_bbox.extend(o_bbox);
 		this->addObject(obj);
 	}
@@ -67,14 +73,14 @@ void Grid::Build(vector<Object*>& objs) {
 	int cellCount = nx * ny * nz;
 
 	// set up a array to hold the objects stored in each cell
-	std::vector<Object*> obj_cell;
+	std::vector<PrimRef> obj_cell;
 	for (int i = 0; i < cellCount; i++) 
 		cells.push_back(obj_cell);   //each cell has an array with zero elements
 		
 	// insert the objects into the cells
 	for (auto &obj : objects) {   //vector iterator
 
-		AABB obb = obj->GetBoundingBox();
+		AABB obb = arena->GetBoundingBox(obj);
 
 		// Compute indices of both cells that contain min and max coord of obj bbox
 		int ixmin = clamp((obb.min.x - bbox.min.x) * nx / (bbox.max.x - bbox.min.x), 0, nx - 1);
@@ -118,38 +124,14 @@ bool Grid::Init_Traverse(Ray& ray, int& ix, int& iy, int& iz, double& dtx, doubl
 	float z1 = bbox.max.z;
 
 	
-	float tx_min, ty_min, tz_min;
-	float tx_max, ty_max, tz_max;
-
-	float a = 1.0 / dx;
-	if (a >= 0) {
-		tx_min = (x0 - ox) * a;
-		tx_max = (x1 - ox) * a;
-	}
-	else {
-		tx_min = (x1 - ox) * a;
-		tx_max = (x0 - ox) * a;
-	}
-
-	float b = 1.0 / dy;
-	if (b >= 0) {
-		ty_min = (y0 - oy) * b;
-		ty_max = (y1 - oy) * b;
-	}
-	else {
-		ty_min = (y1 - oy) * b;
-		ty_max = (y0 - oy) * b;
-	}
+	//branchless slab test with the precomputed inverse direction: MIN/MAX order each slab without testing the sign
+	float ax = (x0 - ox) * ray.inv_direction.x, bx = (x1 - ox) * ray.inv_direction.x;
+	float ay = (y0 - oy) * ray.inv_direction.y, by = (y1 - oy) * ray.inv_direction.y;
+	float az = (z0 - oz) * ray.inv_direction.z, bz = (z1 - oz) * ray.inv_direction.z;
 
-	float c = 1.0 / dz;
-	if (c >= 0) {
-		tz_min = (z0 - oz) * c;
-		tz_max = (z1 - oz) * c;
-	}
-	else {
-		tz_min = (z1 - oz) * c;
-		tz_max = (z0 - oz) * c;
-	}
+	float tx_min = MIN(ax, bx), tx_max = MAX(ax, bx);
+	float ty_min = MIN(ay, by), ty_max = MAX(ay, by);
+	float tz_min = MIN(az, bz), tz_max = MAX(az, bz);
 
 	if (tx_min > ty_min)
 		t0 = tx_min;
@@ -167,7 +149,9 @@ bool Grid::Init_Traverse(Ray& ray, int& ix, int& iy, int& iz, double& dtx, doubl
 	if (tz_max < t1)
 		t1 = tz_max;
 
-	if (t0 > t1 || t1 < 0)   //crossover: ray does not intersect the Grid bounding box OR leaving point is behind the ray origin
+	//crossover: ray does not intersect the Grid bounding box OR leaving point is before the ray interval OR entry point is after it
+	//(ray.tmax already shrunk to a closer hit, of an unbounded primitive for instance)
+	if (t0 > t1 || t1 < ray.tmin || t0 > ray.tmax)
 		return(false);
 
 
@@ -244,7 +228,7 @@ bool Grid::Init_Traverse(Ray& ray, int& ix, int& iy, int& iz, double& dtx, doubl
 }
 
 //-----------------------------------------------------------------------GRID TRAVERSAL
-bool Grid::Traverse(Ray& ray, Object **hitobject, Vector& hitpoint) {
+bool Grid::Traverse(Ray& ray, PrimRef& hitobject, Vector& hitpoint) {
 	int ix, iy, iz;
 	double 	tx_next, ty_next, tz_next;
 	double dtx, dty, dtz; 
@@ -256,63 +240,60 @@ bool Grid::Traverse(Ray& ray, Object **hitobject, Vector& hitpoint) {
 	if (!Init_Traverse(ray, ix, iy, iz, dtx, dty, dtz, tx_next, ty_next, tz_next, ix_step, iy_step, iz_step, ix_stop, iy_stop, iz_stop))
 		return false;   //ray does not intersect the Grid bounding box
 
-	std::vector<Object*> objs;
-	float closestDistance;
-	Object* closestObj = NULL;
 	float distance;
-	
+	bool hit = false;
+
+	//ray.tmax is shrunk to the closest hit found so far, which is kept across cells since an object can be hit beyond the cell that lists it
 	while (true) {
-		objs = cells[ix + nx * iy + nx * ny * iz];
+		std::vector<PrimRef>& objs = cells[ix + nx * iy + nx * ny * iz];
 
-		closestDistance = FLT_MAX;
 		if (objs.size() != 0) 
 			for (auto obj : objs) //intersect Ray with all objects and find the closest hit point(if any)
-				if (obj->intercepts(ray, distance) && distance < closestDistance) {
-					closestDistance = distance;
-					closestObj = obj;
+				if (arena->intercepts(obj, ray, distance)) {
+					ray.tmax = distance;
+					hitobject = obj;
+					hit = true;
 				}
 		
 		if (tx_next < ty_next && tx_next < tz_next) {
-			if (closestDistance < tx_next) {
-					*hitobject = closestObj;
-					hitpoint = ray.origin +ray.direction * closestDistance;
-					return true;
+			if (ray.tmax < tx_next) {  //the closest hit, or the end of the ray interval, is inside this cell
+				if (hit) hitpoint = ray.origin + ray.direction * ray.tmax;
+				return hit;
 			}
 			tx_next += dtx;
 			ix += ix_step;
-			if (ix == ix_stop) return (false);
+			if (ix == ix_stop) break;
 		}
 
 		else if (ty_next < tz_next) {
-				if (closestDistance < ty_next) {
-					*hitobject = closestObj;
-					hitpoint = ray.origin + ray.direction * closestDistance;
-					return true;
+				if (ray.tmax < ty_next) {
+					if (hit) hitpoint = ray.origin + ray.direction * ray.tmax;
+					return hit;
 				}
 				ty_next += dty;
 				iy += iy_step;
-				if (iy == iy_stop) return (false);
+				if (iy == iy_stop) break;
 		}
 
 		else {
-			if (closestDistance < tz_next) {
-				*hitobject = closestObj;
-				hitpoint = ray.origin + ray.direction * closestDistance;
-				return true;
+			if (ray.tmax < tz_next) {
+				if (hit) hitpoint = ray.origin + ray.direction * ray.tmax;
+				return hit;
 			}
 			tz_next += dtz;
 			iz += iz_step;
-			if (iz == iz_stop) return (false);
+			if (iz == iz_stop) break;
 		}
 		
 	}
+
+	//left the grid: a hit found in the last cells is still the closest one
+	if (hit) hitpoint = ray.origin + ray.direction * ray.tmax;
+	return hit;
 }
 
 //-----------------------------------------------------------------------GRID TRAVERSAL FOR SHADOW RAY
-bool Grid::Traverse(Ray& ray) {  
-
-	double length = ray.direction.length(); //distance between light and intersection point
-	ray.direction.normalize();
+bool Grid::Traverse(Ray& ray, PrimRef* occluder) {  //normalized direction with ray.tmax set to the distance to the light
 
 	int ix, iy, iz;
 	double 	tx_next, ty_next, tz_next;
@@ -322,21 +303,26 @@ bool Grid::Traverse(Ray& ray) {
 	int 	ix_stop, iy_stop, iz_stop;
 
 	/*Calculate the initial cell as well as the ray parameter increments per cell in the x, y, and z directions
-	Shadow ray always intersect the Grid bounding box. However due to rounding it may starts at the boundaries, which may result as no intersecting. Consider it as in shadow. */
+	Shadow rays from the unbounded primitives can start outside the Grid, and the ones starting at its boundaries may leave it before ray.tmin:
+	no part of the ray interval is inside the Grid bounding box, so nothing in it occludes the light. */
 	if (!Init_Traverse(ray, ix, iy, iz, dtx, dty, dtz, tx_next, ty_next, tz_next, ix_step, iy_step, iz_step, ix_stop, iy_stop, iz_stop))
-		return true;
+		return false;
 
-	std::vector<Object*> objs;
 	float distance;
 
 	while (true) {
-		objs = cells[ix + nx * iy + nx * ny * iz];
+		std::vector<PrimRef>& objs = cells[ix + nx * iy + nx * ny * iz];
 		if (objs.size() != 0) 
 			//intersect Ray with all objects of each cell
 			for (auto &obj : objs) {
-				if (obj->intercepts(ray, distance) && distance < length) 
+				if (arena->intercepts(obj, ray, distance)) {
+					if (occluder != NULL) *occluder = obj;
 					return true;
+				}
 			}
+
+		if (MIN3(tx_next, ty_next, tz_next) > ray.tmax)  //the light is inside this cell
+			return false;
 		
 		if (tx_next < ty_next && tx_next < tz_next) {
 			tx_next += dtx;
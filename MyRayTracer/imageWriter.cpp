@@ -0,0 +1,506 @@
+#include <string.h>
+
+#include "imageWriter.h"
+#include "maths.h"
+
+//Files over 2 GB (a 16k x 16k PFM) need 64-bit offsets
+#ifdef _WIN32
+#define fseek64 _fseeki64
+#define ftell64 _ftelli64
+#else
+#define fseek64 fseeko
+#define ftell64 ftello
+#endif
+
+#define PNG_MAX_BLOCK 65535	//largest stored deflate block
+#define ADLER_BASE 65521
+
+static const uint8_t png_signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+
+static uint32_t crc_table[256];
+
+static uint32_t crc32(const uint8_t* data, size_t size, uint32_t crc = 0)
+{
+	if (crc_table[1] == 0) {
+		for (uint32_t n = 0; n < 256; n++) {
+			uint32_t c = n;
+			for (int k = 0; k < 8; k++) c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+			crc_table[n] = c;
+		}
+	}
+	crc = ~crc;
+	for (size_t i = 0; i < size; i++) crc = crc_table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+	return ~crc;
+}
+
+static void put_u32_be(vector<uint8_t>& out, uint32_t v)
+{
+	out.push_back(v >> 24); out.push_back(v >> 16); out.push_back(v >> 8); out.push_back(v);
+}
+
+static void put_u32_le(vector<uint8_t>& out, uint32_t v)
+{
+	out.push_back(v); out.push_back(v >> 8); out.push_back(v >> 16); out.push_back(v >> 24);
+}
+
+static void put_f32_le(vector<uint8_t>& out, float f)	//the float formats are written from little endian machines
+{
+	uint32_t v;
+	memcpy(&v, &f, 4);
+	put_u32_le(out, v);
+}
+
+static uint32_t get_u32_be(const uint8_t* p)
+{
+	return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+//Appends a PNG chunk: length, type, data and the CRC of type and data
+static void append_chunk(vector<uint8_t>& out, const char* type, const uint8_t* data, size_t size)
+{
+	size_t start = out.size();
+	put_u32_be(out, (uint32_t)size);
+	out.insert(out.end(), type, type + 4);
+	out.insert(out.end(), data, data + size);
+	put_u32_be(out, crc32(&out[start + 4], size + 4));
+}
+
+static void adler32(uint32_t& a, uint32_t& b, const uint8_t* data, size_t size)
+{
+	while (size > 0) {
+		size_t n = size < 5552 ? size : 5552;	//largest run that cannot overflow b before the modulo
+		size -= n;
+		while (n--) { a += *data++; b += a; }
+		a %= ADLER_BASE;
+		b %= ADLER_BASE;
+	}
+}
+
+//OpenEXR attribute: name, type, size and value
+static void put_exr_attribute(vector<uint8_t>& out, const char* name, const char* type, const vector<uint8_t>& value)
+{
+	out.insert(out.end(), name, name + strlen(name) + 1);
+	out.insert(out.end(), type, type + strlen(type) + 1);
+	put_u32_le(out, (uint32_t)value.size());
+	out.insert(out.end(), value.begin(), value.end());
+}
+
+static ImageFormat format_of(const char* filename)
+{
+	const char* ext = strrchr(filename, '.');
+	if (ext != NULL && (strcmp(ext, ".pfm") == 0 || strcmp(ext, ".PFM") == 0)) return PFM_IMAGE;
+	if (ext != NULL && (strcmp(ext, ".png") == 0 || strcmp(ext, ".PNG") == 0)) return PNG_IMAGE;
+	if (ext != NULL && (strcmp(ext, ".exr") == 0 || strcmp(ext, ".EXR") == 0)) return EXR_IMAGE;
+	return PPM_IMAGE;
+}
+
+// --------------------------------------------------------------------- tone mapping
+static const char* tonemap_names[NUM_TONEMAPS] = { "clamp", "reinhard", "aces" };
+
+static inline float aces(float x)	//curve fit of the ACES filmic tone mapping by K. Narkowicz
+{
+	return (x * (2.51f * x + 0.03f)) / (x * (2.43f * x + 0.59f) + 0.14f);
+}
+
+Color ToneMap(const Color& color, ToneMapOperator op, float exposure)
+{
+	Color c = exposure == 0.0f ? color : color * powf(2.0f, exposure);
+
+	if (op == REINHARD_TONEMAP) c = Color(c.r() / (1.0f + c.r()), c.g() / (1.0f + c.g()), c.b() / (1.0f + c.b()));
+	else if (op == ACES_TONEMAP) c = Color(aces(c.r()), aces(c.g()), aces(c.b()));
+	return c.clamp();
+}
+
+const char* ToneMapName(ToneMapOperator op)
+{
+	return tonemap_names[op];
+}
+
+bool ParseToneMap(const char* name, ToneMapOperator& op)
+{
+	for (int i = 0; i < NUM_TONEMAPS; i++) {
+		if (strcmp(name, tonemap_names[i]) == 0) {
+			op = (ToneMapOperator)i;
+			return true;
+		}
+	}
+	return false;
+}
+
+// --------------------------------------------------------------------- image writer
+ImageWriter::ImageWriter(void) : file(NULL), format(PPM_IMAGE), tonemap(CLAMP_TONEMAP), tonemap_exposure(0.0f), res_x(0),
+	res_y(0), rows(0), rows_done(0), patching(false), header_size(0), complete(false), adler_a(1), adler_b(0) {}
+
+ImageWriter::~ImageWriter()
+{
+	if (file != NULL) fclose(file);
+}
+
+int ImageWriter::GetNextRow()
+{
+	return IsTopDown() ? rows - 1 - rows_done : rows_done;
+}
+
+//Bytes of a row in PPM, PFM and EXR files, or of the data of its IDAT chunk in PNG ones
+size_t ImageWriter::RowSize(int row)
+{
+	if (format == PPM_IMAGE) return 3 * (size_t)res_x;
+	if (format == PFM_IMAGE) return 3 * sizeof(float) * res_x;
+	if (format == EXR_IMAGE) return 8 + 3 * sizeof(float) * res_x;	//row number and data size before the data
+
+	size_t scanline = 1 + 3 * (size_t)res_x;	//filter type byte and the pixels
+	size_t blocks = (scanline + PNG_MAX_BLOCK - 1) / PNG_MAX_BLOCK;
+	return scanline + 5 * blocks + (row == 0 ? 2 : 0) + (row == res_y - 1 ? 4 : 0);	//zlib header and Adler-32 around the stream
+}
+
+long long ImageWriter::RowOffset(int row)
+{
+	if (format != PNG_IMAGE) return header_size + row * (long long)RowSize(0);
+	if (row == 0) return header_size;
+	return header_size + 12 + RowSize(0) + (row - 1) * (long long)(12 + RowSize(0) - 2);	//chunk length, type and CRC around the data
+}
+
+void ImageWriter::EncodeHeader(vector<uint8_t>& header)
+{
+	char text[64];
+
+	header.clear();
+	if (format == PNG_IMAGE) {
+		uint8_t ihdr[13];
+		vector<uint8_t> size;
+		put_u32_be(size, res_x);
+		put_u32_be(size, res_y);
+		memcpy(ihdr, &size[0], 8);
+		ihdr[8] = 8;	//bit depth
+		ihdr[9] = 2;	//RGB
+		ihdr[10] = ihdr[11] = ihdr[12] = 0;	//deflate, adaptive filtering, no interlace
+
+		header.assign(png_signature, png_signature + 8);
+		append_chunk(header, "IHDR", ihdr, 13);
+		return;
+	}
+	if (format == EXR_IMAGE) {
+		vector<uint8_t> value;
+
+		put_u32_le(header, 20000630);	//magic number
+		put_u32_le(header, 2);			//version 2, single part scanline file
+
+		for (const char* channel = "BGR"; *channel; channel++) {	//channels are sorted by name
+			value.push_back(*channel);
+			value.push_back(0);
+			put_u32_le(value, 2);		//FLOAT
+			put_u32_le(value, 0);		//pLinear and reserved bytes
+			put_u32_le(value, 1);		//x and y sampling
+			put_u32_le(value, 1);
+		}
+		value.push_back(0);
+		put_exr_attribute(header, "channels", "chlist", value);
+
+		value.assign(1, 0);				//NO_COMPRESSION
+		put_exr_attribute(header, "compression", "compression", value);
+
+		value.clear();
+		put_u32_le(value, 0); put_u32_le(value, 0); put_u32_le(value, res_x - 1); put_u32_le(value, res_y - 1);
+		put_exr_attribute(header, "dataWindow", "box2i", value);
+		put_exr_attribute(header, "displayWindow", "box2i", value);
+
+		value.assign(1, 0);				//INCREASING_Y
+		put_exr_attribute(header, "lineOrder", "lineOrder", value);
+
+		value.clear();
+		put_f32_le(value, 1.0f);
+		put_exr_attribute(header, "pixelAspectRatio", "float", value);
+		put_exr_attribute(header, "screenWindowWidth", "float", value);
+
+		value.clear();
+		put_f32_le(value, 0.0f); put_f32_le(value, 0.0f);
+		put_exr_attribute(header, "screenWindowCenter", "v2f", value);
+
+		header.push_back(0);			//end of the header
+
+		//uncompressed rows all have the same size, so the table of their offsets is known before any is written
+		uint64_t offset = header.size() + 8 * (uint64_t)res_y;
+		for (int y = 0; y < res_y; y++, offset += RowSize(y)) {
+			put_u32_le(header, (uint32_t)offset);
+			put_u32_le(header, (uint32_t)(offset >> 32));
+		}
+		return;
+	}
+	if (format == PFM_IMAGE) sprintf(text, "PF\n%d %d\n-1.0\n", res_x, res_y);	//negative scale: little endian floats
+	else sprintf(text, "P6\n%d %d\n255\n", res_x, res_y);
+	header.assign(text, text + strlen(text));
+}
+
+bool ImageWriter::Open(const char* filename, int a_res_x, int a_res_y, bool resume)
+{
+	format = format_of(filename);
+	res_x = a_res_x;
+	res_y = a_res_y;
+	rows = res_y;
+	rows_done = 0;
+	patching = false;
+	complete = false;
+	adler_a = 1;
+	adler_b = 0;
+
+	vector<uint8_t> header;
+	EncodeHeader(header);
+	header_size = header.size();
+
+	if (resume && (file = fopen(filename, "r+b")) != NULL) {
+		if (ResumeFrom(header)) return true;
+		fclose(file);
+		rows_done = 0;
+		adler_a = 1;
+		adler_b = 0;
+	}
+
+	file = fopen(filename, "wb");
+	if (file == NULL) return false;
+	return fwrite(&header[0], 1, header.size(), file) == header.size() && fflush(file) == 0;
+}
+
+bool ImageWriter::OpenPatch(const char* filename, int a_res_x, int a_res_y, const ImageRegion& region)
+{
+	format = format_of(filename);
+	res_x = a_res_x;
+	res_y = a_res_y;
+	rows = region.Height();
+	rows_done = 0;
+	patching = true;
+	patch = region;
+	complete = true;	//the trailer of the PNG is there already
+
+	if (region.x0 < 0 || region.y0 < 0 || region.x1 > res_x || region.y1 > res_y || region.Width() <= 0 || rows <= 0)
+		return false;
+
+	vector<uint8_t> header, existing;
+	EncodeHeader(header);
+	header_size = header.size();
+	long long size = RowOffset(res_y - 1) + RowSize(res_y - 1) + (format == PNG_IMAGE ? 12 : 0);	//with IEND
+
+	file = fopen(filename, "r+b");
+	if (file == NULL) return false;
+
+	existing.resize(header.size());
+	if (fread(&existing[0], 1, existing.size(), file) != existing.size() || existing != header ||
+		fseek64(file, 0, SEEK_END) != 0 || ftell64(file) < size) {
+		fclose(file);
+		file = NULL;
+		return false;
+	}
+	return true;
+}
+
+//Keeps the rows an earlier run of the same image completed, and leaves the file positioned after them
+bool ImageWriter::ResumeFrom(const vector<uint8_t>& header)
+{
+	vector<uint8_t> existing(header.size());
+
+	if (fread(&existing[0], 1, existing.size(), file) != existing.size() || existing != header) return false;
+
+	if (format == PNG_IMAGE) {
+		uint8_t chunk_head[8];
+		long long position = header_size;
+
+		while (fread(chunk_head, 1, 8, file) == 8) {
+			size_t size = get_u32_be(chunk_head);
+
+			if (memcmp(chunk_head + 4, "IEND", 4) == 0) {
+				complete = rows_done == res_y;
+				break;
+			}
+			if (memcmp(chunk_head + 4, "IDAT", 4) != 0 || rows_done == res_y || size != RowSize(rows_done)) break;
+
+			buffer.resize(size + 4);
+			if (fread(&buffer[0], 1, size + 4, file) != size + 4) break;
+			if (crc32(&buffer[0], size, crc32(chunk_head + 4, 4)) != get_u32_be(&buffer[size])) break;
+
+			//the scanline bytes of the stored blocks, for the Adler-32 of the whole stream
+			size_t offset = rows_done == 0 ? 2 : 0;
+			size_t scanline = 1 + 3 * (size_t)res_x;
+			while (scanline > 0) {
+				size_t n = scanline < PNG_MAX_BLOCK ? scanline : PNG_MAX_BLOCK;
+				adler32(adler_a, adler_b, &buffer[offset + 5], n);
+				offset += 5 + n;
+				scanline -= n;
+			}
+
+			rows_done++;
+			position += 12 + size;
+		}
+		return fseek64(file, position, SEEK_SET) == 0;
+	}
+
+	if (fseek64(file, 0, SEEK_END) != 0) return false;
+	long long rows = (ftell64(file) - header_size) / (long long)RowSize(0);
+	rows_done = rows < res_y ? (int)rows : res_y;
+	complete = rows_done == res_y;
+	return fseek64(file, header_size + rows_done * (long long)RowSize(0), SEEK_SET) == 0;
+}
+
+//Data of the IDAT chunk of a row: its scanline in stored deflate blocks, after the zlib header if it is the first row
+//and before the Adler-32 of the whole stream if it is the last one
+void ImageWriter::EncodePNGRow(int row, const vector<uint8_t>& scanline, vector<uint8_t>& data)
+{
+	data.clear();
+	if (row == 0) {
+		data.push_back(0x78);	//zlib header: deflate with a 32K window, no dictionary
+		data.push_back(0x01);
+	}
+	for (size_t offset = 0; offset < scanline.size(); offset += PNG_MAX_BLOCK) {
+		size_t n = scanline.size() - offset < PNG_MAX_BLOCK ? scanline.size() - offset : PNG_MAX_BLOCK;
+		bool last = row == res_y - 1 && offset + n == scanline.size();
+		data.push_back(last ? 1 : 0);	//BFINAL and BTYPE 00 (stored)
+		data.push_back(n & 0xFF); data.push_back(n >> 8);
+		data.push_back(~n & 0xFF); data.push_back((~n >> 8) & 0xFF);
+		data.insert(data.end(), scanline.begin() + offset, scanline.begin() + offset + n);
+	}
+	if (row == res_y - 1) put_u32_be(data, adler_b << 16 | adler_a);
+}
+
+//Scanline of a row of the PNG file, out of the stored blocks of its IDAT chunk
+bool ImageWriter::ReadPNGRow(int row, vector<uint8_t>& scanline)
+{
+	size_t size = RowSize(row);
+	buffer.resize(size);
+	if (fseek64(file, RowOffset(row) + 8, SEEK_SET) != 0 || fread(&buffer[0], 1, size, file) != size) return false;
+
+	scanline.clear();
+	size_t offset = row == 0 ? 2 : 0;
+	size_t left = 1 + 3 * (size_t)res_x;
+	while (left > 0) {
+		size_t n = left < PNG_MAX_BLOCK ? left : PNG_MAX_BLOCK;
+		scanline.insert(scanline.end(), buffer.begin() + offset + 5, buffer.begin() + offset + 5 + n);
+		offset += 5 + n;
+		left -= n;
+	}
+	return true;
+}
+
+//Overwrites the pixels of the patched region in viewport row y of the file
+bool ImageWriter::PatchRow(int y, const Color* pixels)
+{
+	int row = IsTopDown() ? res_y - 1 - y : y;
+	int x0 = patch.x0, n = patch.Width();
+	long long offset = RowOffset(row);
+
+	buffer.clear();
+	if (format == PFM_IMAGE) {
+		for (int x = 0; x < n; x++) {
+			put_f32_le(buffer, pixels[x].r());
+			put_f32_le(buffer, pixels[x].g());
+			put_f32_le(buffer, pixels[x].b());
+		}
+		return fseek64(file, offset + 3 * sizeof(float) * x0, SEEK_SET) == 0 &&
+			fwrite(&buffer[0], 1, buffer.size(), file) == buffer.size();
+	}
+	if (format == EXR_IMAGE) {
+		for (int c = 0; c < 3; c++) {	//the channels of a row are one after the other, B, G then R
+			buffer.clear();
+			for (int x = 0; x < n; x++) put_f32_le(buffer, c == 0 ? pixels[x].b() : c == 1 ? pixels[x].g() : pixels[x].r());
+			if (fseek64(file, offset + 8 + sizeof(float) * ((long long)c * res_x + x0), SEEK_SET) != 0 ||
+				fwrite(&buffer[0], 1, buffer.size(), file) != buffer.size()) return false;
+		}
+		return true;
+	}
+
+	vector<uint8_t> bytes;
+	for (int x = 0; x < n; x++) {
+		Color color = ToneMap(pixels[x], tonemap, tonemap_exposure);
+		bytes.push_back(u8fromfloat(color.r()));
+		bytes.push_back(u8fromfloat(color.g()));
+		bytes.push_back(u8fromfloat(color.b()));
+	}
+	if (format == PPM_IMAGE)
+		return fseek64(file, offset + 3 * x0, SEEK_SET) == 0 && fwrite(&bytes[0], 1, bytes.size(), file) == bytes.size();
+
+	//the IDAT chunk of the row is encoded again with its new scanline; the Adler-32 at the end is fixed on Close
+	vector<uint8_t> scanline, data;
+	if (!ReadPNGRow(row, scanline)) return false;
+	memcpy(&scanline[1 + 3 * x0], &bytes[0], bytes.size());
+	EncodePNGRow(row, scanline, data);
+	buffer.clear();
+	append_chunk(buffer, "IDAT", &data[0], data.size());
+	return fseek64(file, offset, SEEK_SET) == 0 && fwrite(&buffer[0], 1, buffer.size(), file) == buffer.size();
+}
+
+bool ImageWriter::WriteRow(const Color* row)
+{
+	if (file == NULL || rows_done == rows) return false;
+
+	if (patching) {
+		if (!PatchRow(patch.y0 + GetNextRow(), row) || fflush(file) != 0) return false;
+		rows_done++;
+		return true;
+	}
+
+	buffer.clear();
+	if (format == PFM_IMAGE) {
+		for (int x = 0; x < res_x; x++) {
+			put_f32_le(buffer, row[x].r());
+			put_f32_le(buffer, row[x].g());
+			put_f32_le(buffer, row[x].b());
+		}
+	}
+	else if (format == EXR_IMAGE) {
+		put_u32_le(buffer, rows_done);
+		put_u32_le(buffer, 3 * sizeof(float) * res_x);
+		for (int x = 0; x < res_x; x++) put_f32_le(buffer, row[x].b());	//one channel after the other
+		for (int x = 0; x < res_x; x++) put_f32_le(buffer, row[x].g());
+		for (int x = 0; x < res_x; x++) put_f32_le(buffer, row[x].r());
+	}
+	else {
+		vector<uint8_t> scanline;
+		if (format == PNG_IMAGE) scanline.push_back(0);	//no filter
+		for (int x = 0; x < res_x; x++) {
+			Color color = ToneMap(row[x], tonemap, tonemap_exposure);
+			scanline.push_back(u8fromfloat(color.r()));
+			scanline.push_back(u8fromfloat(color.g()));
+			scanline.push_back(u8fromfloat(color.b()));
+		}
+
+		if (format == PPM_IMAGE) buffer.swap(scanline);
+		else {
+			vector<uint8_t> data;
+			adler32(adler_a, adler_b, &scanline[0], scanline.size());
+			EncodePNGRow(rows_done, scanline, data);
+			append_chunk(buffer, "IDAT", &data[0], data.size());
+		}
+	}
+
+	if (fwrite(&buffer[0], 1, buffer.size(), file) != buffer.size() || fflush(file) != 0) return false;
+	rows_done++;
+	return true;
+}
+
+bool ImageWriter::Close(void)
+{
+	if (file == NULL) return false;
+
+	bool ok = true;
+	if (format == PNG_IMAGE && patching) {	//Adler-32 of the patched scanlines, at the end of the last IDAT chunk
+		vector<uint8_t> scanline, data;
+		adler_a = 1;
+		adler_b = 0;
+		for (int row = 0; row < res_y && ok; row++) {
+			ok = ReadPNGRow(row, scanline);
+			if (ok) adler32(adler_a, adler_b, &scanline[0], scanline.size());
+		}
+		if (ok) {
+			EncodePNGRow(res_y - 1, scanline, data);
+			buffer.clear();
+			append_chunk(buffer, "IDAT", &data[0], data.size());
+			ok = fseek64(file, RowOffset(res_y - 1), SEEK_SET) == 0 && fwrite(&buffer[0], 1, buffer.size(), file) == buffer.size();
+		}
+	}
+	if (format == PNG_IMAGE && rows_done == res_y && !complete) {
+		buffer.clear();
+		append_chunk(buffer, "IEND", NULL, 0);
+		ok = fwrite(&buffer[0], 1, buffer.size(), file) == buffer.size();
+		complete = ok;
+	}
+	ok = fclose(file) == 0 && ok;
+	file = NULL;
+	return ok;
+}
@@ -0,0 +1,86 @@
+#ifndef IMAGE_WRITER_H
+#define IMAGE_WRITER_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <vector>
+using namespace std;
+
+#include "color.h"
+
+//Types of image files the writer streams, chosen by the extension of the file name
+typedef enum { PPM_IMAGE, PFM_IMAGE, PNG_IMAGE, EXR_IMAGE } ImageFormat;
+
+//Operators bringing the linear colors of the renderer to the [0, 1] range of 8-bit images and of the display
+typedef enum { CLAMP_TONEMAP, REINHARD_TONEMAP, ACES_TONEMAP, NUM_TONEMAPS } ToneMapOperator;
+
+Color ToneMap(const Color& color, ToneMapOperator op, float exposure);	//exposure in stops
+const char* ToneMapName(ToneMapOperator op);
+bool ParseToneMap(const char* name, ToneMapOperator& op);
+
+//Rectangle of pixels x0 <= x < x1, y0 <= y < y1 of an image, in viewport coordinates (y = 0 is the bottom row)
+struct ImageRegion
+{
+	ImageRegion(void) : x0(0), y0(0), x1(0), y1(0) {}
+	ImageRegion(int a_x0, int a_y0, int a_x1, int a_y1) : x0(a_x0), y0(a_y0), x1(a_x1), y1(a_y1) {}
+	int Width() const { return x1 - x0; }
+	int Height() const { return y1 - y0; }
+
+	int x0, y0, x1, y1;
+};
+
+//Image file written one row at a time as the rows are rendered, so a render never holds the whole image in memory.
+//Each row is flushed once written: after a crash the complete rows are still on disk and the render can resume there.
+//  .ppm  binary 8-bit RGB (P6), rows from the top
+//  .pfm  32-bit float RGB, rows from the bottom
+//  .png  8-bit RGB, rows from the top, each one in its own IDAT chunk as uncompressed (stored) deflate blocks
+//  .exr  32-bit float RGB, rows from the top, uncompressed scanlines
+//The float formats keep the linear colors as they are; the 8-bit ones get them tone mapped.
+//A complete image can also be opened to write again only a region of it, in place: the rows then are those of the region.
+class ImageWriter
+{
+public:
+	ImageWriter(void);
+	~ImageWriter();
+
+	//Opens the file for a res_x x res_y image. With resume, an existing file of the same format and size is kept and
+	//the rows complete in it are not written again. Returns false if the file cannot be written.
+	bool Open(const char* filename, int res_x, int res_y, bool resume);
+	//Opens a complete res_x x res_y image written by an ImageWriter to overwrite the pixels of the region, which then is
+	//the image WriteRow fills. Returns false if the file is not such an image.
+	bool OpenPatch(const char* filename, int res_x, int res_y, const ImageRegion& region);
+	void SetToneMap(ToneMapOperator op, float exposure) { tonemap = op; tonemap_exposure = exposure; }
+	bool IsHDR() { return format == PFM_IMAGE || format == EXR_IMAGE; }
+	bool WriteRow(const Color* row);	//linear colors of row GetNextRow() from left to right
+	bool Close(void);					//writes what the format needs after the last row and closes the file
+
+	int GetNextRow();					//viewport y (0 at the bottom) of the row WriteRow expects, in the region if patching
+	bool IsTopDown() { return format != PFM_IMAGE; }	//rows go from the top of the image to the bottom
+	int GetRowsDone() { return rows_done; }
+	bool Done() { return rows_done == rows; }
+
+private:
+	void EncodeHeader(vector<uint8_t>& header);
+	bool ResumeFrom(const vector<uint8_t>& header);	//finds the complete rows of an existing file and moves past them
+	size_t RowSize(int row);
+	long long RowOffset(int row);	//where a row starts in the file, rows counted in the order of the file
+	void EncodePNGRow(int row, const vector<uint8_t>& scanline, vector<uint8_t>& data);
+	bool ReadPNGRow(int row, vector<uint8_t>& scanline);
+	bool PatchRow(int y, const Color* pixels);
+
+	FILE* file;
+	ImageFormat format;
+	ToneMapOperator tonemap;
+	float tonemap_exposure;
+	int res_x, res_y;
+	int rows;					//rows to write: res_y, or the height of the patched region
+	int rows_done;
+	bool patching;
+	ImageRegion patch;			//region rewritten by WriteRow when patching
+	long long header_size;		//bytes before the first row
+	bool complete;				//the file already ends with its trailer
+	uint32_t adler_a, adler_b;	//running Adler-32 of the PNG scanlines, for the end of the zlib stream
+	vector<uint8_t> buffer;		//encoded row
+};
+
+#endif
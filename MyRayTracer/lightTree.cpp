@@ -0,0 +1,103 @@
+#include <algorithm>
+#include <cmath>
+
+#include "lightTree.h"
+#include "macros.h"
+
+void LightTree::Build(const vector<Light*>& a_lights, const Vector& spread)
+{
+	lights = a_lights;
+	nodes.clear();
+	if (lights.empty()) return;
+
+	vector<int> order(lights.size());
+	for (size_t i = 0; i < order.size(); i++) order[i] = (int)i;
+	nodes.reserve(2 * lights.size() - 1);
+	BuildRecursive(order, 0, (int)order.size(), spread);
+}
+
+int LightTree::BuildRecursive(vector<int>& order, int begin, int end, const Vector& spread)
+{
+	int index = (int)nodes.size();
+	nodes.push_back(Node());
+
+	Node node;
+	Vector first = lights[order[begin]]->position;
+	AABB centroids(first, first);
+	node.bbox = AABB(first - spread, first + spread);
+	node.power = 0.0f;
+	for (int i = begin; i < end; i++) {
+		Vector position = lights[order[i]]->position;
+		centroids.extend(AABB(position, position));
+		node.bbox.extend(AABB(position - spread, position + spread));
+		node.power += lights[order[i]]->color.luminance();
+	}
+
+	if (end - begin == 1) {
+		node.light = order[begin];
+		node.right = -1;
+	}
+	else {
+		//median split along the largest extent of the positions
+		Vector extent = centroids.max - centroids.min;
+		int axis = extent.x > extent.y && extent.x > extent.z ? 0 : extent.y > extent.z ? 1 : 2;
+		int mid = (begin + end) / 2;
+		nth_element(order.begin() + begin, order.begin() + mid, order.begin() + end, [&](int a, int b) {
+			return lights[a]->position.getAxisValue(axis) < lights[b]->position.getAxisValue(axis);
+		});
+
+		node.light = -1;
+		BuildRecursive(order, begin, mid, spread);
+		node.right = BuildRecursive(order, mid, end, spread);
+	}
+	nodes[index] = node;
+	return index;
+}
+
+//Power of the node times a bound of the cosine between n and the directions from p into the bounding sphere of its box
+float LightTree::Importance(const Node& node, const Vector& p, const Vector& n) const
+{
+	Vector center = (node.bbox.min + node.bbox.max) * 0.5f;
+	Vector d = center - p;
+	float distance = d.length();
+	float radius = (node.bbox.max - node.bbox.min).length() * 0.5f;
+
+	if (distance <= radius) return node.power;	//p is in the sphere, with lights in any direction
+
+	//the directions into the sphere are within an angle theta of d, so the smallest angle to n is phi - theta
+	float cos_phi = (n * d) / distance;
+	float sin_theta = radius / distance;
+	float cos_theta = sqrtf(1.0f - sin_theta * sin_theta);
+	if (cos_phi >= cos_theta) return node.power;
+
+	float sin_phi = sqrtf(MAX(1.0f - cos_phi * cos_phi, 0.0f));
+	float cos_bound = cos_phi * cos_theta + sin_phi * sin_theta;
+	return cos_bound > 0.0f ? node.power * cos_bound : 0.0f;
+}
+
+Light* LightTree::Sample(const Vector& p, const Vector& n, float u, float& pdf) const
+{
+	int index = 0;
+
+	pdf = 1.0f;
+	if (nodes.empty() || Importance(nodes[0], p, n) <= 0.0f) return NULL;
+
+	while (nodes[index].light < 0) {
+		float left = Importance(nodes[index + 1], p, n);
+		float right = Importance(nodes[nodes[index].right], p, n);
+		if (left + right <= 0.0f) return NULL;
+
+		float p_left = left / (left + right);
+		if (u < p_left) {
+			u /= p_left;	//the part of u left for the next choices
+			pdf *= p_left;
+			index = index + 1;
+		}
+		else {
+			u = MIN((u - p_left) / (1.0f - p_left), 0.99999994f);
+			pdf *= 1.0f - p_left;
+			index = nodes[index].right;
+		}
+	}
+	return lights[nodes[index].light];
+}
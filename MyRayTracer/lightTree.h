@@ -0,0 +1,65 @@
+#ifndef LIGHT_TREE_H
+#define LIGHT_TREE_H
+
+#include <vector>
+using namespace std;
+
+#include "scene.h"
+
+#define LIGHT_TREE_STACK_SIZE 64	//median splits: one level per halving of the lights
+
+//Bounding volume hierarchy of the point lights of a scene, to shade a point with many lights without a shadow ray to
+//each one. A node bounds the positions of its lights and sums their power (luminance of their color). The lighting
+//model has no falloff with distance, so what the lights of a node can give a point is bounded by their power times the
+//largest cosine between the normal and a direction into the node: nodes wholly behind the surface are culled, and the
+//others can be sampled in proportion to that bound.
+class LightTree
+{
+public:
+	//spread is the half extent, around the position of a light, of the samples of its area when soft lights are on
+	void Build(const vector<Light*>& lights, const Vector& spread);
+	int GetNumLights() const { return (int)lights.size(); }
+	int GetNumNodes() const { return (int)nodes.size(); }
+
+	//Calls visit(light) for each light that is not behind the surface at point p of normal n
+	template <class Visitor> void Cull(const Vector& p, const Vector& n, Visitor visit) const;
+
+	//Picks a light going down from the root, into each child with a probability proportional to its bound, by the
+	//uniform random number u; pdf is the probability of the light picked. NULL if no light can reach the point.
+	Light* Sample(const Vector& p, const Vector& n, float u, float& pdf) const;
+
+private:
+	struct Node {
+		AABB bbox;
+		float power;
+		int light;		//leaf: index of its light in lights; -1 for an inner node
+		int right;		//inner node: index of the right child, the left one is the next node
+	};
+
+	float Importance(const Node& node, const Vector& p, const Vector& n) const;
+	int BuildRecursive(vector<int>& order, int begin, int end, const Vector& spread);
+
+	vector<Node> nodes;	//the root first
+	vector<Light*> lights;
+};
+
+template <class Visitor> void LightTree::Cull(const Vector& p, const Vector& n, Visitor visit) const
+{
+	int stack[LIGHT_TREE_STACK_SIZE], top = 0;
+
+	if (nodes.empty()) return;
+	stack[top++] = 0;
+	while (top > 0) {
+		int index = stack[--top];
+		const Node& node = nodes[index];
+
+		if (Importance(node, p, n) <= 0.0f) continue;
+		if (node.light >= 0) visit(lights[node.light]);
+		else {
+			stack[top++] = node.right;
+			stack[top++] = index + 1;
+		}
+	}
+}
+
+#endif
@@ -15,6 +15,10 @@
 #include <chrono>
 #include <conio.h>
 #include <limits>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
 
 #include <GL/glew.h>
 #include <GL/freeglut.h>
@@ -24,20 +28,22 @@
 #include "rayAccelerator.h"
 #include "maths.h"
 #include "macros.h"
+#include "imageWriter.h"
+#include "distributed.h"
+#include "lightTree.h"
 	
 //Enable OpenGL drawing.  
 bool drawModeEnabled = true;
 
 bool P3F_scene = true; //choose between P3F scene or a built-in random scene
 
-#define MAX_DEPTH 4  //number of bounces
+#define MAX_DEPTH 4  //default number of bounces
+#define MIN_WEIGHT 0.01f  //default contribution under which secondary rays are not traced
 #define ROUGHNESS 0.3 //roughness parameter for fuzzy reflection
 
 #define AREA_LIGHT_LIGHTS 16  //number of lights in the area light source
 
 #define CAPTION "Whitted Ray-Tracer"
-#define VERTEX_COORD_ATTRIB 0
-#define COLOR_ATTRIB 1
 
 unsigned int FrameCount = 0;
 
@@ -59,22 +65,66 @@ long myTime, timebase = 0, frame = 0;
 char s[32];
 
 
-// Points defined by 2 attributes: positions which are stored in vertices array and colors which are stored in colors array
-float *colors;
-float *vertices;
-int size_vertices;
-int size_colors;
-
-//Array of Pixels to be stored in a file by using DevIL library
-uint8_t *img_Data;
-
-GLfloat m[16];  //projection matrix initialized by ortho function
-
+//Linear RGB float framebuffer of the OpenGL drawing mode: uploaded as is to the display texture, the shader tone maps it
+float *img_Data;
+int size_image;
+
+//Image file of the file mode, written row by row as the render goes (.png, .ppm, .pfm or .exr); with resume_output,
+//the rows an interrupted render already wrote to it are kept. Set with -o <file> and -resume on the command line.
+//The OpenGL drawing mode saves its framebuffer to it with the 's' key.
+const char* output_file = "RT_Output.png";
+bool resume_output = false;
+
+//Tone mapping of the 8-bit outputs and of the display (-tonemap clamp|reinhard|aces, -exposure <stops>);
+//in the OpenGL drawing mode, 't' cycles the operators and '+'/'-' change the exposure without tracing again
+ToneMapOperator tonemap = CLAMP_TONEMAP;
+float exposure = 0.0f;
+
+//Region of the image the file mode renders, set with -crop <x> <y> <width> <height> in pixels from the top left corner
+//of the image. It goes to an image of its size, or with -patch over the same pixels of the full size image already in
+//output_file. -spp <n> replaces the samples per pixel of the scene, to render a noisy region again at a higher quality.
+int crop[4] = { 0, 0, 0, 0 };  //x, y, width and height; no crop with a 0 width
+bool patch_output = false;
+int spp_override = -1;
+
+//Termination of the reflected and refracted rays. Each ray carries its weight, the largest share of the pixel its color
+//can make; the ones under min_weight are dropped, or with -roulette kept at random with a probability weight / min_weight
+//and scaled up by its inverse, which keeps the mean of the samples unbiased. Set with -depth <n> and -min-weight <w>.
+int max_depth = MAX_DEPTH;
+float min_weight = MIN_WEIGHT;
+bool russian_roulette = false;
+
+//Animation: with -frames <n> the file mode renders frames 0 to n - 1 of the keys of the animated instances, each to
+//output_file with its number before the extension. Between frames only the moved instances get new transforms and the
+//BVH is refit, unless its node boxes grew over -refit-limit <x> times their areas after the last build (0 builds it
+//again every frame, to compare).
+int num_frames = 1;
+float refit_limit = BVH_REFIT_LIMIT;
+float scene_time = 0.0f;  //of the poses of the animated instances
+
+//With -budget <seconds>, the file mode renders the region in about that time instead of with the samples of the scene:
+//a first pass of BUDGET_FIRST_SAMPLES random samples per pixel, then BUDGET_BATCH more at a time to the tile with the
+//highest noise estimate, until the time is over. The samples per pixel each tile got and the noise left are reported.
+#define BUDGET_FIRST_SAMPLES 4  //per pixel; the noise estimate needs a few
+#define BUDGET_BATCH 4
+#define BUDGET_DARK 0.1f        //luminance below which the noise of a pixel is not relative to its luminance anymore
+float time_budget = 0.0f;
+
+//Distributed file mode: with -coordinator <port> the image is rendered by the worker processes started with
+//-worker <host:port>, which load the scene of the coordinator by its name in their own P3D_Scenes folder
+Coordinator* coordinator = NULL;
+const char* worker_address = NULL;
+char scene_input[50];  //name of the P3F file of the scene, as input
+
+//The image is drawn as a texture on a full screen quad. Its pixels go through two pixel buffer objects used in turns,
+//so filling one never waits for the texture transfer still reading the other
 GLuint VaoId;
-GLuint VboId[2];
+GLuint TextureId;
+GLuint PboId[2];
+unsigned int PboIndex = 0;
 
 GLuint VertexShaderId, FragmentShaderId, ProgramId;
-GLint UniformId;
+GLint UniformId, ExposureId, ToneMapId;
 
 Scene* scene = NULL;
 
@@ -92,6 +142,65 @@ bool antialiasing = false;
 bool dof = false;
 bool softLights = false;
 
+//Lights of the scene in a light tree: the shading of a point skips the lights behind its surface, or with
+//-light-samples <n> takes n lights picked at random by their importance instead of all of them, for scenes with many
+LightTree light_tree;
+int light_samples = 0;
+
+//Directions drawn from the HDR environment map of the scene, if it has one, to light each hit point with -env-samples <n>
+#define ENV_SAMPLES 8
+int env_samples = ENV_SAMPLES;
+
+//Last occluder found toward each light, per render thread (see pointInShadow), and how often it answered a shadow ray
+#define SHADOW_CACHE_SIZE 256  //slots, one per light in scenes with up to that many
+struct ShadowCache
+{
+	unsigned int scene_id;
+	const Light* light[SHADOW_CACHE_SIZE];
+	PrimRef occluder[SHADOW_CACHE_SIZE];
+	long long rays, occluded, hits;
+};
+static thread_local ShadowCache shadow_cache;
+atomic<long long> shadow_rays(0), shadow_occluded(0), shadow_hits(0);  //counts of the threads, added as their work ends
+unsigned int scene_id = 0;  //changes with every scene loaded, so no thread keeps the occluders of a previous one
+
+//In OpenGL drawing mode, worker threads render the image in tiles and publish each finished tile in img_Data, while the
+//GLUT thread only uploads and presents it every REFRESH_MS. A camera change starts a new render generation: the workers
+//drop the tile they are on at its next row and go on with the new camera.
+#define TILE_SIZE 32
+#define REFRESH_MS 16
+
+//Each generation goes over the tiles in passes. A camera change first reprojects the hit points of the previous image
+//(G-buffer) to the new camera, so only the pixels left invalid (disoccluded, background) have to be traced right away.
+//Those are first previewed at decreasing block sizes, each level shown as soon as its tiles are done. The reprojected
+//pixels are still traced again in the last pass, since specular highlights, reflections and refractions change with the
+//view: reprojection shortens the time until a whole image is on screen, not the work of a camera move.
+#define PREVIEW_LEVELS 3	//preview passes with 8x8, 4x4 and 2x2 blocks
+#define PREVIEW_STEP 8		//block size of the first preview pass, halved at each next one
+enum RenderPass { PREVIEW_PASS, INVALID_PASS = PREVIEW_PASS + PREVIEW_LEVELS, REPROJECTED_PASS, NUM_PASSES };
+//In increasing order of quality; preview pass p fills the pixels of its blocks as PIXEL_PREVIEW + p
+enum PixelState { PIXEL_INVALID, PIXEL_PREVIEW, PIXEL_REPROJECTED = PIXEL_PREVIEW + PREVIEW_LEVELS, PIXEL_TRACED };
+
+struct GSample {
+	Vector point;	//primary hit, of the pixel center or of the first antialiasing sample
+	float depth;	//distance from the eye to point, FLT_MAX if no hit
+	PrimRef prim;	//object of the primary hit
+};
+
+vector<thread> render_workers;
+mutex render_mutex;			//guards the job below, the scene camera and the pixels published in the buffers below
+condition_variable render_cv;
+atomic<unsigned int> render_generation(0);
+int next_tile = 0, num_tiles = 0, tiles_x = 0;	//next_tile counts over the tiles of every pass
+int tiles_done = 0;			//tiles of the generation published, its shadow ray counts being printed after the last one
+bool render_quit = false;
+Vector render_eye;			//camera position of the current generation
+atomic<bool> frame_dirty(false);	//tiles were published since the last upload
+
+GSample *gbuffer, *reproj_gbuffer;	//per pixel primary hit of img_Data, and the buffers the reprojection fills
+uint8_t *pixel_state, *reproj_state;
+float *reproj_image;
+
 
 
 /////////////////////////////////////////////////////////////////////// ERRORS
@@ -118,20 +227,17 @@ void checkOpenGLError(std::string error)
 
 /////////////////////////////////////////////////////////////////////// SHADERs
 
+//Full screen quad from the vertex index (triangle strip of 4 vertices): no vertex data at all
 const GLchar* VertexShader =
 {
 	"#version 430 core\n"
 
-	"in vec2 in_Position;\n"
-	"in vec3 in_Color;\n"
-	"uniform mat4 Matrix;\n"
-	"out vec4 color;\n"
+	"out vec2 tex_Coord;\n"
 
 	"void main(void)\n"
 	"{\n"
-	"	vec4 position = vec4(in_Position, 0.0, 1.0);\n"
-	"	color = vec4(in_Color, 1.0);\n"
-	"	gl_Position = Matrix * position;\n"
+	"	tex_Coord = vec2(gl_VertexID & 1, gl_VertexID >> 1);\n"
+	"	gl_Position = vec4(tex_Coord * 2.0 - 1.0, 0.0, 1.0);\n"
 
 	"}\n"
 };
@@ -140,12 +246,18 @@ const GLchar* FragmentShader =
 {
 	"#version 430 core\n"
 
-	"in vec4 color;\n"
+	"in vec2 tex_Coord;\n"
+	"uniform sampler2D Image;\n"
+	"uniform float Exposure;\n"	//scale of the linear colors
+	"uniform int ToneMap;\n"		//same operators as ToneMap() in imageWriter.cpp
 	"out vec4 out_Color;\n"
 
 	"void main(void)\n"
 	"{\n"
-	"	out_Color = color;\n"
+	"	vec3 c = texture(Image, tex_Coord).rgb * Exposure;\n"
+	"	if (ToneMap == 1) c = c / (1.0 + c);\n"
+	"	else if (ToneMap == 2) c = (c * (2.51 * c + 0.03)) / (c * (2.43 * c + 0.59) + 0.14);\n"
+	"	out_Color = vec4(clamp(c, 0.0, 1.0), 1.0);\n"
 	"}\n"
 };
 
@@ -162,12 +274,11 @@ void createShaderProgram()
 	ProgramId = glCreateProgram();
 	glAttachShader(ProgramId, VertexShaderId);
 	glAttachShader(ProgramId, FragmentShaderId);
-
-	glBindAttribLocation(ProgramId, VERTEX_COORD_ATTRIB, "in_Position");
-	glBindAttribLocation(ProgramId, COLOR_ATTRIB, "in_Color");
 	
 	glLinkProgram(ProgramId);
-	UniformId = glGetUniformLocation(ProgramId, "Matrix");
+	UniformId = glGetUniformLocation(ProgramId, "Image");
+	ExposureId = glGetUniformLocation(ProgramId, "Exposure");
+	ToneMapId = glGetUniformLocation(ProgramId, "ToneMap");
 
 	checkOpenGLError("ERROR: Could not create shaders.");
 }
@@ -185,86 +296,102 @@ void destroyShaderProgram()
 	checkOpenGLError("ERROR: Could not destroy shaders.");
 }
 
-/////////////////////////////////////////////////////////////////////// VAOs & VBOs
+/////////////////////////////////////////////////////////////////////// VAO, TEXTURE & PBOs
 
 void createBufferObjects()
 {
+	//the quad has no vertex attributes, but the core profile still needs a bound VAO to draw
 	glGenVertexArrays(1, &VaoId);
-	glBindVertexArray(VaoId);
-	glGenBuffers(2, VboId);
-	glBindBuffer(GL_ARRAY_BUFFER, VboId[0]);
-
-	/* S�Ese faz a aloca��o dos arrays glBufferData (NULL), e o envio dos pontos para a placa gr�fica
-	�Efeito na drawPoints com GlBufferSubData em tempo de execu��o pois os arrays s�o GL_DYNAMIC_DRAW */
-	glBufferData(GL_ARRAY_BUFFER, size_vertices, NULL, GL_DYNAMIC_DRAW);
-	glEnableVertexAttribArray(VERTEX_COORD_ATTRIB);
-	glVertexAttribPointer(VERTEX_COORD_ATTRIB, 2, GL_FLOAT, 0, 0, 0);
-	
-	glBindBuffer(GL_ARRAY_BUFFER, VboId[1]);
-	glBufferData(GL_ARRAY_BUFFER, size_colors, NULL, GL_DYNAMIC_DRAW);
-	glEnableVertexAttribArray(COLOR_ATTRIB);
-	glVertexAttribPointer(COLOR_ATTRIB, 3, GL_FLOAT, 0, 0, 0);
-	
-// unbind the VAO
-	glBindVertexArray(0);
-    glBindBuffer(GL_ARRAY_BUFFER, 0);
-//	glDisableVertexAttribArray(VERTEX_COORD_ATTRIB); 
-//	glDisableVertexAttribArray(COLOR_ATTRIB);
-	checkOpenGLError("ERROR: Could not create VAOs and VBOs.");
+
+	glGenTextures(1, &TextureId);
+	glBindTexture(GL_TEXTURE_2D, TextureId);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB32F, RES_X, RES_Y, 0, GL_RGB, GL_FLOAT, NULL);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glBindTexture(GL_TEXTURE_2D, 0);
+
+	//only the storage of the two PBOs is allocated here (NULL): drawImage fills one of them per frame, in turns (GL_STREAM_DRAW)
+	glGenBuffers(2, PboId);
+	for (int i = 0; i < 2; i++) {
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, PboId[i]);
+		glBufferData(GL_PIXEL_UNPACK_BUFFER, size_image, NULL, GL_STREAM_DRAW);
+	}
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+	checkOpenGLError("ERROR: Could not create VAO, texture and PBOs.");
 }
 
 void destroyBufferObjects()
 {
-	glDisableVertexAttribArray(VERTEX_COORD_ATTRIB);
-	glDisableVertexAttribArray(COLOR_ATTRIB);
-	
-	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+	glBindTexture(GL_TEXTURE_2D, 0);
 	glBindVertexArray(0);
 
-	glDeleteBuffers(1, VboId);
+	glDeleteBuffers(2, PboId);
+	glDeleteTextures(1, &TextureId);
 	glDeleteVertexArrays(1, &VaoId);
-	checkOpenGLError("ERROR: Could not destroy VAOs and VBOs.");
+	checkOpenGLError("ERROR: Could not destroy VAO, texture and PBOs.");
 }
 
-void drawPoints()
+void drawImage()
 {
 	FrameCount++;
 	glClear(GL_COLOR_BUFFER_BIT);
 
-	glBindVertexArray(VaoId);
-	glUseProgram(ProgramId);
+	glBindTexture(GL_TEXTURE_2D, TextureId);
+
+	//upload only when the render threads published new tiles
+	if (frame_dirty.exchange(false)) {
+		//copy the new pixels into the PBO of this frame; invalidating it lets the driver skip any wait on its old contents
+		PboIndex = 1 - PboIndex;
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, PboId[PboIndex]);
+		void* pixels = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, size_image, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+		if (pixels != NULL) {
+			{
+				lock_guard<mutex> lock(render_mutex);
+				memcpy(pixels, img_Data, size_image);
+			}
+			glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+		}
 
-	glBindBuffer(GL_ARRAY_BUFFER, VboId[0]);
-	glBufferSubData(GL_ARRAY_BUFFER, 0, size_vertices, vertices);
-	glBindBuffer(GL_ARRAY_BUFFER, VboId[1]);
-	glBufferSubData(GL_ARRAY_BUFFER, 0, size_colors, colors);
+		//with a PBO bound the last argument is an offset into it, and the transfer to the texture is asynchronous
+		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, RES_X, RES_Y, GL_RGB, GL_FLOAT, 0);
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+	}
 
-	glUniformMatrix4fv(UniformId, 1, GL_FALSE, m);
-	glDrawArrays(GL_POINTS, 0, RES_X*RES_Y);
-	glFinish();
+	glBindVertexArray(VaoId);
+	glUseProgram(ProgramId);
+	glActiveTexture(GL_TEXTURE0);
+	glUniform1i(UniformId, 0);
+	glUniform1f(ExposureId, powf(2.0f, exposure));
+	glUniform1i(ToneMapId, tonemap);
+	glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
 
 	glUseProgram(0);
 	glBindVertexArray(0);
-	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	glBindTexture(GL_TEXTURE_2D, 0);
 
 	checkOpenGLError("ERROR: Could not draw scene.");
 }
 
-ILuint saveImgFile(const char *filename) {
-	ILuint ImageId;
+//Saves the framebuffer of the OpenGL drawing mode
+bool saveImgFile(const char *filename) {
+	ImageWriter writer;
+	vector<Color> row(RES_X);
 
-	ilEnable(IL_FILE_OVERWRITE);
-	ilGenImages(1, &ImageId);
-	ilBindImage(ImageId);
+	writer.SetToneMap(tonemap, exposure);
+	if (!writer.Open(filename, RES_X, RES_Y, false)) return false;
 
-	ilTexImage(RES_X, RES_Y, 1, 3, IL_RGB, IL_UNSIGNED_BYTE, img_Data /*Texture*/);
-	ilSaveImage(filename);
-
-	ilDisable(IL_FILE_OVERWRITE);
-	ilDeleteImages(1, &ImageId);
-	if (ilGetError() != IL_NO_ERROR)return ilGetError();
-
-	return IL_NO_ERROR;
+	lock_guard<mutex> lock(render_mutex);
+	while (!writer.Done()) {
+		float* pixel = img_Data + 3 * writer.GetNextRow() * RES_X;
+		for (int x = 0; x < RES_X; x++, pixel += 3)
+			row[x] = Color(pixel[0], pixel[1], pixel[2]);
+		if (!writer.WriteRow(&row[0])) return false;
+	}
+	return writer.Close();
 }
 
 /////////////////////////////////////////////////////////////////////// CALLBACKS
@@ -280,6 +407,13 @@ void timer(int value)
 	glutTimerFunc(1000, timer, 0);
 }
 
+//Presents the image at display rate, independently of how far the render threads are
+void refresh(int value)
+{
+	glutPostRedisplay();
+	glutTimerFunc(REFRESH_MS, refresh, 0);
+}
+
 
 // Callback function for glutCloseFunc
 void cleanup()
@@ -288,32 +422,10 @@ void cleanup()
 	destroyBufferObjects();
 }
 
-void ortho(float left, float right, float bottom, float top, 
-			float nearp, float farp)
-{
-	m[0 * 4 + 0] = 2 / (right - left);
-	m[0 * 4 + 1] = 0.0;
-	m[0 * 4 + 2] = 0.0;
-	m[0 * 4 + 3] = 0.0;
-	m[1 * 4 + 0] = 0.0;
-	m[1 * 4 + 1] = 2 / (top - bottom);
-	m[1 * 4 + 2] = 0.0;
-	m[1 * 4 + 3] = 0.0;
-	m[2 * 4 + 0] = 0.0;
-	m[2 * 4 + 1] = 0.0;
-	m[2 * 4 + 2] = -2 / (farp - nearp);
-	m[2 * 4 + 3] = 0.0;
-	m[3 * 4 + 0] = -(right + left) / (right - left);
-	m[3 * 4 + 1] = -(top + bottom) / (top - bottom);
-	m[3 * 4 + 2] = -(farp + nearp) / (farp - nearp);
-	m[3 * 4 + 3] = 1.0;
-}
-
 void reshape(int w, int h)
 {
     glClear(GL_COLOR_BUFFER_BIT);
-	glViewport(0, 0, w, h);
-	ortho(0, (float)RES_X, 0, (float)RES_Y, -1.0, 1.0);
+	glViewport(0, 0, w, h);  //the quad covers the whole window, whatever its size
 }
 
 void processKeys(unsigned char key, int xx, int yy)
@@ -337,6 +449,22 @@ void processKeys(unsigned char key, int xx, int yy)
 			printf("Camera Spherical Coordinates (%f, %f, %f)\n", r, beta, alpha);
 			printf("Camera Cartesian Coordinates (%f, %f, %f)\n", camX, camY, camZ);
 			break;
+
+		case 's':
+			if (saveImgFile(output_file)) printf("Image file %s created\n", output_file);
+			else printf("Error saving Image file %s\n", output_file);
+			break;
+
+		case 't':
+			tonemap = (ToneMapOperator)((tonemap + 1) % NUM_TONEMAPS);
+			printf("Tone mapping: %s\n", ToneMapName(tonemap));
+			break;
+
+		case '+':
+		case '-':
+			exposure += key == '+' ? 0.5f : -0.5f;
+			printf("Exposure: %+.1f stops\n", exposure);
+			break;
 	}
 }
 
@@ -463,153 +591,243 @@ void setupGLUT(int argc, char* argv[])
 
 /////////////////////////////////////////////////////YOUR CODE HERE///////////////////////////////////////////////////////////////////////////////////////
 
-bool pointInShadow(Vector origin, Vector direction, float distanceToLight) {
-	Ray ray = Ray(origin, direction);
-	int numObjects = scene->getNumObjects();
-	for (int i = 0; i < numObjects; i++) {
-		Object* object = scene->getObject(i);
-		float distance = 0;
-		if (object->intercepts(ray, distance)) {
-			if (distanceToLight > distance) {
-				return true;
-			}
-		}
+//Tells if the light at distanceToLight from origin, in direction, is occluded. The occluder found toward a light is kept
+//in the cache of the thread and tried first the next time: neighbouring shading points mostly share it. A NULL source,
+//a direction of the environment, has no slot.
+bool pointInShadow(const Light* source, Vector origin, Vector direction, float distanceToLight) {
+	Ray ray = Ray(origin, direction, EPSILON, distanceToLight);
+	SceneArena& arena = scene->GetArena();
+	ShadowCache& cache = shadow_cache;
+	size_t slot = ((uintptr_t)source / sizeof(Light)) % SHADOW_CACHE_SIZE;  //lights are next to each other in the arena
+	PrimRef occluder;
+	float t;
+	bool occluded;
+
+	if (cache.scene_id != scene_id) {  //the occluders of another scene
+		memset(cache.light, 0, sizeof(cache.light));
+		cache.scene_id = scene_id;
 	}
-	return false;
+	cache.rays++;
+
+	if (source != NULL && cache.light[slot] == source && arena.intercepts(cache.occluder[slot], ray, t)) {
+		cache.occluded++;
+		cache.hits++;
+		return true;
+	}
+
+	if (Accel_Struct == accelerator::GRID_ACC)
+		occluded = arena.OccludedIn(scene->getUnboundedPrimitives(), ray, &occluder) || grid_ptr->Traverse(ray, &occluder);
+	else if (Accel_Struct == accelerator::BVH_ACC)
+		occluded = arena.OccludedIn(scene->getUnboundedPrimitives(), ray, &occluder) || bvh_ptr->Traverse(ray, &occluder);
+	else
+		occluded = arena.Occluded(ray, &occluder);
+
+	if (occluded) {
+		cache.occluded++;
+		if (source == NULL) return true;
+		cache.light[slot] = source;
+		cache.occluder[slot] = occluder;
+	}
+	return occluded;
 }
 
-Color softShadowLight(Light* light, Vector pointOfContact, Ray ray, Material* material, Vector normal) {
-	bool inShadow = false;
-	Vector lightDirection = light->position - pointOfContact;
+//Diffuse and specular light of the given color coming from lightDirection; none from behind the surface, so the lights
+//the light tree culls for being behind it are exactly the ones that add nothing
+static inline Color blinnPhong(const Color& lightColor, const Vector& lightDirection, const Ray& ray, Material* material, const Vector& normal)
+{
+	float cos_light = normal * lightDirection;
+	if (cos_light <= 0.0F) return Color();
+
+	Vector h = (lightDirection - ray.direction).normalize();
+	Color diffuse = lightColor * material->GetDiffColor() * cos_light * material->GetDiffuse();
+	Color specular = lightColor * material->GetSpecColor() * powf(MAX(h * normal, 0.0F), material->GetShine()) * material->GetSpecular();
+
+	return diffuse + specular;
+}
+
+//source is the light of the scene the light shaded stands for, a sample of its area with soft lights
+Color softShadowLight(Light* light, Vector hitPoint, Ray ray, Material* material, Vector normal, const Light* source) {
+	Vector lightDirection = light->position - hitPoint;
 	float distanceToLight = lightDirection.length();
 	lightDirection = lightDirection.normalize();
 
-	if (Accel_Struct == accelerator::GRID_ACC) {
-		inShadow = grid_ptr->Traverse(Ray(pointOfContact, light->position - pointOfContact));
-	}
-	else if (Accel_Struct == accelerator::BVH_ACC) {
-		inShadow = bvh_ptr->Traverse(Ray(pointOfContact, light->position - pointOfContact));
+	bool inShadow = pointInShadow(source, hitPoint, lightDirection, distanceToLight);
+
+	if (!inShadow) { //trace shadow ray
+		return blinnPhong(light->color, lightDirection, ray, material, normal);
 	}
 	else {
-		inShadow = pointInShadow(pointOfContact, lightDirection, distanceToLight);
+		//Return Shadow
+		return Color(0, 0, 0);
 	}
-			
+}
 
-	if (!inShadow) { //trace shadow ray
-		Vector h = (lightDirection - ray.direction).normalize();
-		Vector lightColor = Vector(light->color.r(), light->color.g(), light->color.b());
-		Vector diffColor = Vector(material->GetDiffColor().r(), material->GetDiffColor().g(), material->GetDiffColor().b());
-		Vector specColor = Vector(material->GetSpecColor().r(), material->GetSpecColor().g(), material->GetSpecColor().b());
-		Vector diffuse = Vector(lightColor.x * diffColor.x, lightColor.y * diffColor.y, lightColor.z * diffColor.z) * max(normal * lightDirection, 0.0F) * material->GetDiffuse();
-		Vector specular = Vector(lightColor.x * specColor.x, lightColor.y * specColor.y, lightColor.z * specColor.z) * powf(max(h * normal, 0.0F), material->GetShine()) * material->GetSpecular();
+//Light of the environment map at the hit point: env_samples directions drawn by its radiance, each unoccluded one
+//shading the point like a light of its radiance over its pdf. The 1/PI makes a uniform environment of radiance 1 light
+//a surface facing it like a white light straight above.
+Color environmentLight(const Vector& hitPoint, const Ray& ray, Material* material, const Vector& normal)
+{
+	const EnvironmentMap& environment = scene->GetEnvironment();
+	Color color;
 
-		Vector blinnPhong = diffuse + specular;
-		return Color(blinnPhong.x, blinnPhong.y, blinnPhong.z);
+	for (int s = 0; s < env_samples; s++) {
+		Vector direction;
+		float pdf;
+		Color radiance = environment.Sample(rand_float(), rand_float(), direction, pdf);
+		if (pdf <= 0.0f || normal * direction <= 0.0f) continue;
+		if (!pointInShadow(NULL, hitPoint, direction, FLT_MAX))
+			color += blinnPhong(radiance * (1.0f / (PI * pdf)), direction, ray, material, normal);
+	}
+	return color * (1.0f / env_samples);
+}
+
+
+//Light of one light source at the hit point: of the point light itself, or of samples of an area around it with soft lights
+Color directLight(Light* light, const Vector& hitPoint, const Ray& ray, Material* material, const Vector& normal)
+{
+	Color color;
+
+	if (softLights) {
+		if (antialiasing) {
+			// for dof
+			/*
+			Vector pixel = Vector(light->position.x - 1.0f, light->position.y - 1.0f, light->position.z);
+			pixel = pixel + Vector(2.0f, 0.0f, 0.0f) * rand_float();
+			pixel = pixel + Vector(0.0f, 2.0f, 0.0f) * rand_float();
+			*/
+			Vector pixel = Vector(light->position.x - 3.0f, light->position.y, light->position.z - 3.0f);
+			pixel = pixel + Vector(6.0f, 0.0f, 0.0f) * rand_float();
+			pixel = pixel + Vector(0.0f, 0.0f, 6.0f) * rand_float();
+
+			Light NLight(pixel, light->color);
+			color += softShadowLight(&NLight, hitPoint, ray, material, normal, light);
+		}
+		else {
+			float spacing = 1.0f / sqrtf(AREA_LIGHT_LIGHTS);
+			Color brightness = light->color * (1.0f / AREA_LIGHT_LIGHTS);
+			float initial_offset = -(1.0f / 2.0f) + (spacing / 2);
+
+			for (int j = 0; j < sqrtf(AREA_LIGHT_LIGHTS); j++) {
+				for (int k = 0; k < sqrtf(AREA_LIGHT_LIGHTS); k++) {
+					//Original point light will be in a corner of the area light source
+					Light Nlight(light->position + Vector(initial_offset + (j * spacing), 0.0, initial_offset + (k * spacing)), brightness);
+					color += softShadowLight(&Nlight, hitPoint, ray, material, normal, light);
+				}
+			}
+		}
 	}
 	else {
-		//Return Shadow
-		return Color(0, 0, 0);
+		color += softShadowLight(light, hitPoint, ray, material, normal, light);
 	}
+	return color;
+}
+
+//Adds the counts of the calling thread to the totals of every thread
+void addShadowCacheStats()
+{
+	ShadowCache& cache = shadow_cache;
+	shadow_rays += cache.rays;
+	shadow_occluded += cache.occluded;
+	shadow_hits += cache.hits;
+	cache.rays = cache.occluded = cache.hits = 0;
 }
 
+//Shadow rays of every thread since the last report, and how many the shadow cache answered
+void printShadowCacheStats()
+{
+	addShadowCacheStats();
+	long long rays = shadow_rays.exchange(0), occluded = shadow_occluded.exchange(0), hits = shadow_hits.exchange(0);
+	if (rays == 0) return;
+	printf("Shadow rays: %lld, %lld occluded, %lld of those (%.1f%%) by the cached occluder\n", rays, occluded, hits,
+		occluded > 0 ? 100.0 * hits / occluded : 0.0);
+}
+
+//Tells if a secondary ray of the given weight is traced, and the factor its color is scaled by
+static inline bool traceSecondary(float weight, float& scale)
+{
+	scale = 1.0f;
+	if (weight >= min_weight) return true;
+	if (!russian_roulette || weight <= 0.0f) return false;
+
+	float survival = weight / min_weight;
+	if (rand_float() >= survival) return false;
+	scale = 1.0f / survival;
+	return true;
+}
+
+//Color of a ray that hits nothing: of the skybox, the environment map or the background
+static inline Color missColor(const Ray& ray)
+{
+	if (scene->GetSkyBoxFlg()) return scene->GetSkyboxColor(ray);
+	if (scene->GetEnvironment().IsLoaded()) return scene->GetEnvironment().Lookup(ray.direction);
+	return scene->GetBackgroundColor();
+}
 
-Color rayTracing(Ray ray, int depth, float ior_1)  //index of refraction of medium 1 where the ray is travelling
+Color rayTracing(Ray ray, int depth, float ior_1, float weight = 1.0f, GSample* gsample = NULL)  //index of refraction of medium 1 where the ray is travelling
 {
 	Color color;
 
+	if (gsample != NULL) gsample->depth = FLT_MAX;  //no hit unless found below
+
 	float smallestDistance = std::numeric_limits<float>::infinity();
-	Object* closestObject = NULL;
+	SceneArena& arena = scene->GetArena();
+	PrimRef closestObject;
+	bool hit = false;
 	
 	Vector hitPoint;
 
 	if (Accel_Struct == GRID_ACC) {
-		if (!grid_ptr->Traverse(ray, &closestObject, hitPoint)) {
-			if (scene->GetSkyBoxFlg()) {
-				return scene->GetSkyboxColor(ray).clamp();
-			}
-			else {
-				return scene->GetBackgroundColor().clamp();
-			}
+		//unbounded primitives first: a plane hit shrinks ray.tmax, so the grid only looks for closer hits
+		hit = arena.ClosestIn(scene->getUnboundedPrimitives(), ray, closestObject);
+		hit = grid_ptr->Traverse(ray, closestObject, hitPoint) || hit;
+		if (!hit) {
+			return missColor(ray);
 		}
 	}
 	else if (Accel_Struct == BVH_ACC) {
-		if (!bvh_ptr->Traverse(ray, &closestObject, hitPoint)) {
-			if (scene->GetSkyBoxFlg()) {
-				return scene->GetSkyboxColor(ray).clamp();
-			}
-			else {
-				return scene->GetBackgroundColor().clamp();
-			}
+		hit = arena.ClosestIn(scene->getUnboundedPrimitives(), ray, closestObject);
+		hit = bvh_ptr->Traverse(ray, closestObject, hitPoint) || hit;
+		if (!hit) {
+			return missColor(ray);
 		}
 	}
 	else {
-		int numObjects = scene->getNumObjects();
-		for (int i = 0; i < numObjects; i++) {
-			Object* object = scene->getObject(i);
-			float distance = 0;
-			if (object->intercepts(ray, distance)) {
-				if (distance < smallestDistance) {
-					closestObject = object;
-					smallestDistance = distance;
-				}
-			}
-		}
+		hit = arena.Closest(ray, closestObject, smallestDistance);
 	}
 
-	if (closestObject == NULL) {
-		return scene->GetBackgroundColor();
+	if (!hit) {
+		return missColor(ray);
 	}
 
-	hitPoint = Accel_Struct == accelerator::NONE ? ray.origin + ray.direction * smallestDistance : hitPoint;  //Accel_Struct != accelerator::NONE ? hitPoint :
-	Vector normal = closestObject->getNormal(hitPoint);  // still missing  // error here?
+	hitPoint = ray.origin + ray.direction * ray.tmax;  //every path leaves ray.tmax at the closest hit
+	if (gsample != NULL) {
+		gsample->point = hitPoint;
+		gsample->depth = ray.tmax;
+		gsample->prim = closestObject;
+	}
+	Vector normal = arena.getNormal(closestObject, hitPoint);
 	bool inside = (ray.direction * normal) > 0;
-	float bias = 0.001F;
-	Vector pointOfContact = hitPoint + normal * EPSILON;
-	Material* material = closestObject->GetMaterial();
+	//secondary rays start at the hit point itself, their interval beginning at EPSILON keeps them from hitting the same surface again
+	Material* material = arena.getObject(closestObject)->GetMaterial();
 
 	if (!inside) {
-		int numLights = scene->getNumLights();
-		for (int i = 0; i < numLights; i++) {
-			Light* light = scene->getLight(i);
-
-			if (softLights) {
-				if (antialiasing) {
-							// for dof
-							/*
-							Vector pixel = Vector(light->position.x - 1.0f, light->position.y - 1.0f, light->position.z);
-							pixel = pixel + Vector(2.0f, 0.0f, 0.0f) * rand_float();
-							pixel = pixel + Vector(0.0f, 2.0f, 0.0f) * rand_float();
-							*/
-							Vector pixel = Vector(light->position.x - 3.0f, light->position.y, light->position.z - 3.0f);
-							pixel = pixel + Vector(6.0f, 0.0f, 0.0f) * rand_float();
-							pixel = pixel + Vector(0.0f, 0.0f, 6.0f) * rand_float();
-							
-							Light* NLight = new Light(pixel, light->color);
-							color += softShadowLight(NLight, pointOfContact, ray, material, normal);
-				}
-				else {
-					float spacing = 1.0f / sqrtf(AREA_LIGHT_LIGHTS);
-					Color brightness = light->color * (1.0f / AREA_LIGHT_LIGHTS);
-					float initial_offset = -(1.0f / 2.0f) + (spacing / 2);
-
-					for (int j = 0; j < sqrtf(AREA_LIGHT_LIGHTS); j++) {
-						for (int k = 0; k < sqrtf(AREA_LIGHT_LIGHTS); k++) {
-							//Original point light will be in a corner of the area light source
-							Light* Nlight = new Light(light->position + Vector(initial_offset + (j * spacing), 0.0, initial_offset + (k * spacing)), brightness);
-							color += softShadowLight(Nlight, pointOfContact, ray, material, normal);
-						}
-					}
-
-				}
+		if (light_samples > 0) {  //an unbiased estimate with a few lights picked by their importance
+			for (int s = 0; s < light_samples; s++) {
+				float pdf;
+				Light* light = light_tree.Sample(hitPoint, normal, rand_float(), pdf);
+				if (light != NULL) color += directLight(light, hitPoint, ray, material, normal) * (1.0f / (light_samples * pdf));
 			}
-			else {
-				color += softShadowLight(light, pointOfContact, ray, material, normal);
-			}		
 		}
+		else {
+			light_tree.Cull(hitPoint, normal, [&](Light* light) {
+				color += directLight(light, hitPoint, ray, material, normal);
+			});
+		}
+		if (env_samples > 0 && scene->GetEnvironment().IsLoaded()) color += environmentLight(hitPoint, ray, material, normal);
 	}
 
-	if (depth > MAX_DEPTH) {
-		return color.clamp();
+	if (depth > max_depth) {
+		return color;
 	}
 
 	normal = inside ? normal * -1 : normal;
@@ -618,25 +836,21 @@ Color rayTracing(Ray ray, int depth, float ior_1)  //index of refraction of medi
 	Color rColor;
 	Color tColor;
 
-	float reflection = closestObject->GetMaterial()->GetReflection();
+	float reflection = material->GetReflection();
 	bool reflective = reflection > 0.0F;
-	if (reflective) {
 
-		Vector reflectionDirection = (normal * (2 * (normal * V)) - V).normalize();
-		Vector fuzzyReflectionDirection = (reflectionDirection + ((rnd_unit_sphere() * ROUGHNESS))).normalize();
-
-		Ray rRay = Ray(pointOfContact, (fuzzyReflectionDirection * normal) > 0.0F ? fuzzyReflectionDirection : reflectionDirection);
-		rColor = rayTracing(rRay, depth + 1, ior_1); // * reflection
-	}
-
-	float refraction = closestObject->GetMaterial()->GetRefrIndex();
-	float transmittance = closestObject->GetMaterial()->GetTransmittance();
+	float refraction = material->GetRefrIndex();
+	float transmittance = material->GetTransmittance();
 	bool transparent = transmittance == 1.0F;
 
+	//the Fresnel term is known before tracing, so the weights of both rays are
 	float Kr = reflection;
+	float nextIor = 1.0F;
+	Vector refractionDirection;
+	bool refracted = false;
 
 	if (transparent) {
-		float nextIor = !inside ? refraction : 1.0F;
+		nextIor = !inside ? refraction : 1.0F;
 		float n = ior_1 / nextIor;
 
 		Vector Vt = (normal * (normal * V)) - V;
@@ -650,106 +864,524 @@ Color rayTracing(Ray ray, int depth, float ior_1)  //index of refraction of medi
 			float cosI = inside ? cosT : sqrtf(1 - (sinI * sinI));
 			Kr = r0 + ((1 - r0) * powf(1 - cosI, 5));
 
-			Vector refractionDirection = (t * sinT + normal * -cosT).normalize();
-			Vector pointOfTransmitance = hitPoint + normal * -EPSILON;
-			Ray rRay = Ray(pointOfTransmitance, refractionDirection);
-
-			tColor = rayTracing(rRay, depth + 1, nextIor);
+			refractionDirection = (t * sinT + normal * -cosT).normalize();
+			refracted = true;
 		}
 	}
 
+	float scale;
+	if (reflective && traceSecondary(weight * Kr, scale)) {
+
+		Vector reflectionDirection = (normal * (2 * (normal * V)) - V).normalize();
+		Vector fuzzyReflectionDirection = (reflectionDirection + ((rnd_unit_sphere() * ROUGHNESS))).normalize();
+
+		Ray rRay = Ray(hitPoint, (fuzzyReflectionDirection * normal) > 0.0F ? fuzzyReflectionDirection : reflectionDirection, EPSILON);
+		rRay.spread = ray.spread;  //the cone as if the surface were flat
+		rColor = rayTracing(rRay, depth + 1, ior_1, weight * Kr * scale) * scale; // * reflection
+	}
+
+	if (refracted && traceSecondary(weight * (1 - Kr), scale)) {
+		Ray rRay = Ray(hitPoint, refractionDirection, EPSILON);
+		rRay.spread = ray.spread;
+
+		tColor = rayTracing(rRay, depth + 1, nextIor, weight * (1 - Kr) * scale) * scale;
+	}
+
 	color += rColor * Kr + tColor * (1 - Kr);
 
-	return color.clamp();
+	return color;  //linear and unbounded: outputs tone map it
 }
 
 
 
-// Render function by primary ray casting from the eye towards the scene's objects
+// Color of one pixel by primary ray casting from the eye towards the scene's objects; gsample gets the primary hit
 
-void renderScene()
+Color renderPixel(Camera* camera, int x, int y, GSample* gsample = NULL)
 {
-	set_rand_seed(time(NULL) * time(NULL));
+	Color color;
 
-	int index_pos = 0;
-	int index_col = 0;
-	unsigned int counter = 0;
+	Vector pixel;  //viewport coordinates
+	
+	if (antialiasing) {
+		for (int p = 0; p < spp; p++) {
+			for (int q = 0; q < spp; q++) {
+				pixel.x = x + (p + rand_float()) / spp;
+				pixel.y = y + (q + rand_float()) / spp;
+				Ray ray = Ray(Vector(0.0F, 0.0F, 0.0F), Vector(0.0F, 0.0F, 0.0F));
+				if (dof) {
+					Vector lens_sample = rnd_unit_disk();
+					ray = camera->PrimaryRay(lens_sample, pixel);
+				}
+				else {
+					ray = camera->PrimaryRay(pixel);   //function from camera.h
+				}
+				ray.spread /= spp;  //each sample stands for a sub-pixel
+				color += rayTracing(ray, 1, 1.0, 1.0f, p == 0 && q == 0 ? gsample : NULL);
+			}
+		}
 
-	if (drawModeEnabled) {
-		glClear(GL_COLOR_BUFFER_BIT);
-		scene->GetCamera()->SetEye(Vector(camX, camY, camZ));  //Camera motion
+		color = color * (1 / pow(spp, 2));
 	}
+	else {
+		
+		pixel.x = x + 0.5f;
+		pixel.y = y + 0.5f;
 
-	for (int y = 0; y < RES_Y; y++)
-	{
-		for (int x = 0; x < RES_X; x++)
-		{
-			Color color;
-
-			Vector pixel;  //viewport coordinates
-			
-			if (antialiasing) {
-				for (int p = 0; p < spp; p++) {
-					for (int q = 0; q < spp; q++) {
-						pixel.x = x + (p + rand_float()) / spp;
-						pixel.y = y + (q + rand_float()) / spp;
-						Ray ray = Ray(Vector(0.0F, 0.0F, 0.0F), Vector(0.0F, 0.0F, 0.0F));
-						if (dof) {
-							Vector lens_sample = rnd_unit_disk();
-							ray = scene->GetCamera()->PrimaryRay(lens_sample, pixel);
-						}
-						else {
-							ray = scene->GetCamera()->PrimaryRay(pixel);   //function from camera.h
-						}
-						color += rayTracing(ray, 1, 1.0).clamp();
-					}
-				}
+		//YOUR 2 FUNTIONS:
+		Ray ray = camera->PrimaryRay(pixel);   //function from camera.h
 
-				color = color * (1 / pow(spp, 2));
-			}
-			else {
-				
-				pixel.x = x + 0.5f;
-				pixel.y = y + 0.5f;
+		color = rayTracing(ray, 1, 1.0, 1.0f, gsample);
+	
+	}
+
+	return color;
+}
+
+/////////////////////////////////////////////////////////////////////// TIME BUDGETED RENDERING
+
+//Samples taken so far in a tile, per pixel the sum of their colors and of their squared luminances
+struct BudgetTile
+{
+	int x0, y0, x1, y1;
+	int samples;  //per pixel, the same for all the pixels of the tile
+	float error;  //noise estimate
+	vector<Color> sum;
+	vector<double> sum2;
+};
 
-				//YOUR 2 FUNTIONS:
-				Ray ray = scene->GetCamera()->PrimaryRay(pixel);   //function from camera.h
+// Color of one sample of a pixel, through a random point of it (and of the lens with depth of field)
 
-				color = rayTracing(ray, 1, 1.0).clamp();
-			
+Color samplePixel(Camera* camera, int x, int y)
+{
+	Vector pixel = Vector(x + rand_float(), y + rand_float(), 0.0f);
+	Ray ray = dof ? camera->PrimaryRay(rnd_unit_disk(), pixel) : camera->PrimaryRay(pixel);
+	return rayTracing(ray, 1, 1.0);
+}
+
+//Adds samples to every pixel of the tile and updates its noise estimate: the RMS over its pixels of the standard error
+//of their mean luminance, relative to that luminance
+void sampleTile(Camera* camera, BudgetTile& tile, int samples)
+{
+	int width = tile.x1 - tile.x0;
+
+	for (int y = tile.y0; y < tile.y1; y++) {
+		for (int x = tile.x0; x < tile.x1; x++) {
+			int i = (y - tile.y0) * width + x - tile.x0;
+			for (int s = 0; s < samples; s++) {
+				Color color = samplePixel(camera, x, y);
+				float lum = color.luminance();
+				tile.sum[i] += color;
+				tile.sum2[i] += lum * lum;
 			}
-			
-			
-			//color = scene->GetBackgroundColor(); //TO CHANGE - just for the template
+		}
+	}
+	tile.samples += samples;
+
+	double n = tile.samples, error = 0.0;
+	for (size_t i = 0; i < tile.sum.size(); i++) {
+		double mean = tile.sum[i].luminance() / n;
+		double variance = MAX(tile.sum2[i] / n - mean * mean, 0.0) * n / (n - 1);
+		double scale = MAX(mean, BUDGET_DARK);
+		error += variance / (n * scale * scale);
+	}
+	tile.error = (float)sqrt(error / tile.sum.size());
+}
 
-			img_Data[counter++] = u8fromfloat((float)color.r());
-			img_Data[counter++] = u8fromfloat((float)color.g());
-			img_Data[counter++] = u8fromfloat((float)color.b());
+//Renders the region in the time budget and writes the mean of the samples of each pixel; false if the image cannot
+//be written
+bool renderBudget(const ImageRegion& region, ImageWriter& writer)
+{
+	Camera* camera = scene->GetCamera();
+	auto start = chrono::steady_clock::now();
+	auto deadline = start + chrono::duration_cast<chrono::steady_clock::duration>(chrono::duration<double>(time_budget));
+	int tiles_x = (region.Width() + TILE_SIZE - 1) / TILE_SIZE;
+	int tiles_y = (region.Height() + TILE_SIZE - 1) / TILE_SIZE;
+	vector<BudgetTile> tiles(tiles_x * tiles_y);
+
+	antialiasing = true;  //the soft shadows are sampled at random as well
+
+	for (int t = 0; t < (int)tiles.size(); t++) {
+		BudgetTile& tile = tiles[t];
+		tile.x0 = region.x0 + (t % tiles_x) * TILE_SIZE;
+		tile.y0 = region.y0 + (t / tiles_x) * TILE_SIZE;
+		tile.x1 = MIN(tile.x0 + TILE_SIZE, region.x1);
+		tile.y1 = MIN(tile.y0 + TILE_SIZE, region.y1);
+		tile.samples = 0;
+		tile.sum.assign((tile.x1 - tile.x0) * (tile.y1 - tile.y0), Color());
+		tile.sum2.assign(tile.sum.size(), 0.0);
+		sampleTile(camera, tile, BUDGET_FIRST_SAMPLES);
+	}
+	if (chrono::steady_clock::now() > deadline)
+		printf("The first pass took %.2f s, over the budget of %.2f s\n", chrono::duration<double>(chrono::steady_clock::now() - start).count(), time_budget);
+
+	while (chrono::steady_clock::now() < deadline) {
+		size_t noisiest = 0;
+		for (size_t t = 1; t < tiles.size(); t++)
+			if (tiles[t].error > tiles[noisiest].error) noisiest = t;
+		sampleTile(camera, tiles[noisiest], BUDGET_BATCH);
+	}
 
-			if (drawModeEnabled) {
-				vertices[index_pos++] = (float)x;
-				vertices[index_pos++] = (float)y;
-				colors[index_col++] = (float)color.r();
+	//samples per pixel of each tile, laid out as the image
+	int min_spp = tiles[0].samples, max_spp = 0;
+	double samples = 0.0, noise = 0.0;
+	printf("Samples per pixel of the %dx%d tiles:\n", TILE_SIZE, TILE_SIZE);
+	for (int ty = tiles_y - 1; ty >= 0; ty--) {
+		for (int tx = 0; tx < tiles_x; tx++) {
+			BudgetTile& tile = tiles[ty * tiles_x + tx];
+			printf("%5d", tile.samples);
+			min_spp = MIN(min_spp, tile.samples);
+			max_spp = MAX(max_spp, tile.samples);
+			samples += (double)tile.samples * tile.sum.size();
+			noise += (double)tile.error * tile.error * tile.sum.size();
+		}
+		printf("\n");
+	}
+	double pixels = (double)region.Width() * region.Height();
+	printf("%d to %d samples per pixel, %.1f on average; noise estimate %.4f\n", min_spp, max_spp, samples / pixels, sqrt(noise / pixels));
+
+	vector<Color> row(region.Width());
+	while (!writer.Done()) {
+		int y = writer.GetNextRow();
+		for (int x = 0; x < region.Width(); x++) {
+			BudgetTile& tile = tiles[(y / TILE_SIZE) * tiles_x + x / TILE_SIZE];
+			int i = (region.y0 + y - tile.y0) * (tile.x1 - tile.x0) + region.x0 + x - tile.x0;
+			row[x] = tile.sum[i] * (1.0f / tile.samples);
+		}
+		if (!writer.WriteRow(&row[0])) return false;
+	}
+	return true;
+}
 
-				colors[index_col++] = (float)color.g();
+//Moves the animated instances to their poses at time and brings the accelerator up to date
+void updateScene(float time)
+{
+	if (time == scene_time) return;
+	scene_time = time;
+	if (scene->getNumAnimated() == 0) return;
+
+	auto timeStart = std::chrono::high_resolution_clock::now();
+	scene->Animate(time);
+
+	char update[64] = "no accelerator";
+	if (Accel_Struct == BVH_ACC) {
+		float growth = bvh_ptr->Refit();
+		snprintf(update, sizeof(update), "BVH refit, node areas %.2fx the build", growth);
+		if (growth > refit_limit) {
+			delete bvh_ptr;
+			bvh_ptr = new BVH();
+			bvh_ptr->Build(scene->getPrimitives(), scene->GetArena());
+			strcat(update, ", rebuilt");
+		}
+	}
+	else if (Accel_Struct == GRID_ACC) {
+		delete grid_ptr;
+		grid_ptr = new Grid();
+		grid_ptr->Build(scene->getPrimitives(), scene->GetArena());
+		strcpy(update, "grid rebuilt");
+	}
+	auto timeEnd = std::chrono::high_resolution_clock::now();
+	printf("Time %g: %d animated instances moved, %s: %.3f ms\n", time, scene->getNumAnimated(), update,
+		std::chrono::duration<double, std::milli>(timeEnd - timeStart).count());
+}
 
-				colors[index_col++] = (float)color.b();
-			}
+//Name of the image file of a frame of an animation: out_0007.png for the frame 7 of out.png
+string frameFileName(const char* name, int frame)
+{
+	string file(name);
+	size_t dot = file.rfind('.');
+	char number[16];
+
+	snprintf(number, sizeof(number), "_%04d", frame);
+	return dot == string::npos ? file + number : file.substr(0, dot) + number + file.substr(dot);
+}
+
+// Render function of the whole image to be stored in a file; each row goes to the file as soon as it is done
+
+void renderScene()
+{
+	ImageWriter writer;
+	ImageRegion region(0, 0, RES_X, RES_Y);
+
+	if (crop[2] > 0) {  //from the rows of the image, top down, to those of the viewport, clipped to the image
+		region = ImageRegion(MAX(crop[0], 0), MAX(RES_Y - crop[1] - crop[3], 0), MIN(crop[0] + crop[2], RES_X), MIN(RES_Y - crop[1], RES_Y));
+		if (region.Width() <= 0 || region.Height() <= 0) {
+			printf("The crop region is outside the %dx%d image\n", RES_X, RES_Y);
+			exit(0);
 		}
+	}
+	vector<Color> row(region.Width());
+
+	set_rand_seed(time(NULL) * time(NULL));
 
+	writer.SetToneMap(tonemap, exposure);
+	if (patch_output) {
+		if (!writer.OpenPatch(output_file, RES_X, RES_Y, region)) {
+			printf("Error opening image file %s: a complete %dx%d image of the renderer is needed to patch\n", output_file, RES_X, RES_Y);
+			exit(0);
+		}
 	}
-	if (drawModeEnabled) {
-		drawPoints();
-		glutSwapBuffers();
+	else if (!writer.Open(output_file, region.Width(), region.Height(), resume_output)) {
+		printf("Error opening image file %s\n", output_file);
+		exit(0);
 	}
-	else {
-		printf("Terminou o desenho!\n");
-		if (saveImgFile("RT_Output.png") != IL_NO_ERROR) {
-			printf("Error saving Image file\n");
+	if (writer.GetRowsDone() > 0) printf("Resuming %s: %d of %d rows already done\n", output_file, writer.GetRowsDone(), region.Height());
+
+	if (coordinator != NULL) {
+		TileJob settings;
+		settings.spp = antialiasing ? spp : 0;
+		settings.max_depth = max_depth;
+		settings.min_weight = min_weight;
+		settings.roulette = russian_roulette;
+		settings.light_samples = light_samples;
+		settings.env_samples = env_samples;
+		settings.time = scene_time;
+		if (!coordinator->Render(scene_input, scene->GetCamera()->GetEye(), settings, region, writer)) {
+			printf("Error writing image file %s\n", output_file);
 			exit(0);
 		}
-		printf("Image file created\n");
 	}
+	else if (time_budget > 0.0f && !renderBudget(region, writer)) {
+		printf("Error writing image file %s\n", output_file);
+		exit(0);
+	}
+	while (!writer.Done()) {
+		int y = region.y0 + writer.GetNextRow();
+		for (int x = region.x0; x < region.x1; x++)
+			row[x - region.x0] = renderPixel(scene->GetCamera(), x, y);
+
+		if (!writer.WriteRow(&row[0])) {
+			printf("Error writing image file %s\n", output_file);
+			exit(0);
+		}
+	}
+
+	printShadowCacheStats();
+	printf("Terminou o desenho!\n");
+	if (!writer.Close()) {
+		printf("Error saving Image file\n");
+		exit(0);
+	}
+	printf("Image file created\n");
+}
+
+/////////////////////////////////////////////////////////////////////// BACKGROUND RENDERING
+
+//Tells if a pixel in the given state is rendered by the pass
+static inline bool passRenders(int pass, uint8_t state)
+{
+	if (pass < INVALID_PASS) return state < PIXEL_PREVIEW + (pass - PREVIEW_PASS);
+	if (pass == INVALID_PASS) return state < PIXEL_REPROJECTED;
+	return state == PIXEL_REPROJECTED;
+}
+
+//Renders the pixels of a tile that the pass is for. tile_data and tile_state come in with the published colors and
+//states of the pixels; tile_state leaves with the new state of every pixel rewritten in tile_data, and PIXEL_INVALID
+//for the ones left as they are. Returns false as soon as the render generation changes.
+bool renderTile(Camera* camera, int pass, unsigned int generation, int x0, int y0, int x1, int y1,
+	float* tile_data, uint8_t* tile_state, GSample* tile_gsamples)
+{
+	//a preview pass traces one ray per block, through its first pixel, and fills with it the other pixels of the block
+	//worse than its level; the blocks of a level nest in those of the previous one, so a first pixel is traced only once
+	int step = pass < INVALID_PASS ? PREVIEW_STEP >> (pass - PREVIEW_PASS) : 1;
+	uint8_t preview = PIXEL_PREVIEW + (pass - PREVIEW_PASS);
+
+	for (int by = y0; by < y1; by += step) {
+		for (int bx = x0; bx < x1; bx += step) {
+			int bx1 = MIN(bx + step, x1), by1 = MIN(by + step, y1);
+			int first = (by - y0) * TILE_SIZE + (bx - x0);
+			bool needed = false;
+
+			for (int y = by; y < by1; y++)
+				for (int x = bx; x < bx1; x++)
+					needed = needed || passRenders(pass, tile_state[(y - y0) * TILE_SIZE + (x - x0)]);
+
+			bool traced = false;
+			if (needed && tile_state[first] != PIXEL_TRACED) {
+				Color color = renderPixel(camera, bx, by, &tile_gsamples[first]);
+				tile_data[3 * first] = color.r();
+				tile_data[3 * first + 1] = color.g();
+				tile_data[3 * first + 2] = color.b();
+				traced = true;
+			}
+
+			for (int y = by; y < by1; y++) {
+				for (int x = bx; x < bx1; x++) {
+					int i = (y - y0) * TILE_SIZE + (x - x0);
+					if (i == first) {
+						tile_state[i] = traced ? PIXEL_TRACED : PIXEL_INVALID;
+					}
+					else if (needed && passRenders(pass, tile_state[i])) {
+						memcpy(tile_data + 3 * i, tile_data + 3 * first, 3 * sizeof(float));
+						tile_state[i] = preview;
+					}
+					else tile_state[i] = PIXEL_INVALID;
+				}
+			}
+		}
+		if (render_generation != generation) return false;  //the camera moved: this tile is stale
+	}
+	return true;
+}
+
+void renderWorker(int id)
+{
+	float tile_data[3 * TILE_SIZE * TILE_SIZE];
+	uint8_t tile_state[TILE_SIZE * TILE_SIZE];
+	GSample tile_gsamples[TILE_SIZE * TILE_SIZE];
+
+	set_rand_seed(time(NULL) * time(NULL) + id);  //rand() keeps its state per thread in the MSVC runtime
+
+	while (true) {
+		unique_lock<mutex> lock(render_mutex);
+		render_cv.wait(lock, [] { return render_quit || next_tile < NUM_PASSES * num_tiles; });
+		if (render_quit) return;
+
+		int pass = next_tile / num_tiles, tile = next_tile % num_tiles;
+		next_tile++;
+		unsigned int generation = render_generation;
+		Camera camera = *scene->GetCamera();  //the GLUT thread moves the scene camera while this tile renders
+
+		int x0 = (tile % tiles_x) * TILE_SIZE, y0 = (tile / tiles_x) * TILE_SIZE;
+		int x1 = MIN(x0 + TILE_SIZE, RES_X), y1 = MIN(y0 + TILE_SIZE, RES_Y);
+		for (int y = y0; y < y1; y++) {
+			memcpy(tile_data + 3 * (y - y0) * TILE_SIZE, img_Data + 3 * (y * RES_X + x0), 3 * sizeof(float) * (x1 - x0));
+			memcpy(tile_state + (y - y0) * TILE_SIZE, pixel_state + y * RES_X + x0, x1 - x0);
+		}
+		lock.unlock();
+
+		bool rendered = renderTile(&camera, pass, generation, x0, y0, x1, y1, tile_data, tile_state, tile_gsamples);
+		addShadowCacheStats();
+		if (!rendered) continue;
+
+		lock.lock();
+		if (generation == render_generation) {
+			//another worker may have refined some of these pixels meanwhile: only better states are published
+			for (int y = y0; y < y1; y++) {
+				for (int x = x0; x < x1; x++) {
+					int i = (y - y0) * TILE_SIZE + (x - x0), j = y * RES_X + x;
+					if (tile_state[i] <= pixel_state[j]) continue;
+					memcpy(img_Data + 3 * j, tile_data + 3 * i, 3 * sizeof(float));
+					pixel_state[j] = tile_state[i];
+					if (tile_state[i] == PIXEL_TRACED) gbuffer[j] = tile_gsamples[i];
+				}
+			}
+			frame_dirty = true;
+			if (++tiles_done == NUM_PASSES * num_tiles) printShadowCacheStats();
+		}
+	}
+}
+
+//Moves the primary hits of the current image to where the new camera sees them: each one lands on a single pixel, the
+//nearest one wins. Pixels no hit lands on (disocclusions, background) are left invalid with their old color, and the ones
+//where hits of different objects meet are silhouettes, kept only as a preview. Called with render_mutex held.
+void reprojectFrame(Camera* camera)
+{
+	int n_pixels = RES_X * RES_Y;
+
+	memcpy(reproj_image, img_Data, size_image);
+	memset(reproj_state, PIXEL_INVALID, n_pixels);
+
+	if (!dof) {  //with depth of field the hit of a pixel depends on its lens sample
+		Vector eye = camera->GetEye();
+
+		for (int y = 0; y < RES_Y; y++) {
+			for (int x = 0; x < RES_X; x++) {
+				int i = y * RES_X + x;
+				if (pixel_state[i] < PIXEL_REPROJECTED || gbuffer[i].depth == FLT_MAX) continue;
+
+				Vector point = gbuffer[i].point;  //not rebuilt from the pixel center: under antialiasing it is a jittered sample
+				float px, py;
+				if (!camera->Project(point, px, py) || px < 0.0f || py < 0.0f || px >= RES_X || py >= RES_Y) continue;
+
+				int j = (int)py * RES_X + (int)px;
+				float depth = (point - eye).length();
+				uint8_t state = PIXEL_REPROJECTED;
+				if (reproj_state[j] != PIXEL_INVALID) {
+					if (reproj_state[j] < PIXEL_REPROJECTED || reproj_gbuffer[j].prim.type != gbuffer[i].prim.type ||
+						reproj_gbuffer[j].prim.index != gbuffer[i].prim.index) state = PIXEL_REPROJECTED - 1;  //as the finest preview
+					if (reproj_gbuffer[j].depth <= depth) {
+						reproj_state[j] = state;
+						continue;
+					}
+				}
+				memcpy(reproj_image + 3 * j, img_Data + 3 * i, 3 * sizeof(float));
+				reproj_gbuffer[j].point = point;
+				reproj_gbuffer[j].depth = depth;
+				reproj_gbuffer[j].prim = gbuffer[i].prim;
+				reproj_state[j] = state;
+			}
+		}
+	}
+
+	swap(img_Data, reproj_image);
+	swap(gbuffer, reproj_gbuffer);
+	swap(pixel_state, reproj_state);
+	frame_dirty = true;
+}
+
+//Starts a render generation with the current camera position; the tiles of the previous one are dropped
+void startRender()
+{
+	{
+		lock_guard<mutex> lock(render_mutex);
+		render_generation++;
+		render_eye = Vector(camX, camY, camZ);
+		scene->GetCamera()->SetEye(render_eye);  //Camera motion
+		reprojectFrame(scene->GetCamera());
+		next_tile = 0;
+		tiles_done = 0;
+	}
+	render_cv.notify_all();
+}
+
+void startRenderWorkers()
+{
+	int n_workers = MAX((int)thread::hardware_concurrency() - 1, 1);  //one core left to the GLUT thread
+	int n_pixels = RES_X * RES_Y;
+
+	tiles_x = (RES_X + TILE_SIZE - 1) / TILE_SIZE;
+	num_tiles = tiles_x * ((RES_Y + TILE_SIZE - 1) / TILE_SIZE);
+	memset(img_Data, 0, size_image);
+
+	gbuffer = new GSample[n_pixels];
+	reproj_gbuffer = new GSample[n_pixels];
+	pixel_state = new uint8_t[n_pixels]();  //all invalid
+	reproj_state = new uint8_t[n_pixels];
+	reproj_image = (float*)malloc(size_image);  //swapped with img_Data
+	if (reproj_image == NULL) exit(1);
+
+	startRender();
+	for (int i = 0; i < n_workers; i++)
+		render_workers.push_back(thread(renderWorker, i));
+	printf("%d render threads\n", n_workers);
+}
+
+void stopRenderWorkers()
+{
+	{
+		lock_guard<mutex> lock(render_mutex);
+		render_quit = true;
+		render_generation++;
+	}
+	render_cv.notify_all();
+	for (thread& worker : render_workers) worker.join();
+	render_workers.clear();
+
+	delete[] gbuffer;
+	delete[] reproj_gbuffer;
+	delete[] pixel_state;
+	delete[] reproj_state;
+	free(reproj_image);
+}
+
+//Display callback: restarts the render when the camera moved, then presents whatever tiles are ready
+void presentFrame()
+{
+	if (camX != render_eye.x || camY != render_eye.y || camZ != render_eye.z)
+		startRender();
+
+	drawImage();
+	glutSwapBuffers();
 }
 
 
@@ -759,14 +1391,14 @@ void setupCallbacks()
 {
 	glutKeyboardFunc(processKeys);
 	glutCloseFunc(cleanup);
-	glutDisplayFunc(renderScene);
+	glutDisplayFunc(presentFrame);
 	glutReshapeFunc(reshape);
 	glutMouseFunc(processMouseButtons);
 	glutMotionFunc(processMouseMotion);
 	glutMouseWheelFunc(mouseWheel);
 
-	glutIdleFunc(renderScene);
 	glutTimerFunc(0, timer, 0);
+	glutTimerFunc(REFRESH_MS, refresh, 0);
 }
 void init(int argc, char* argv[])
 {
@@ -786,24 +1418,31 @@ void init(int argc, char* argv[])
 	createShaderProgram();
 	createBufferObjects();
 	setupCallbacks();
+	startRenderWorkers();
 }
 
 
-void init_scene(void)
+//Loads the P3F scene named scene_file, or the one the user inputs if NULL
+void init_scene(const char* scene_file = NULL)
 {
 	char scenes_dir[70] = "P3D_Scenes/";
-	char input_user[50];
 	char scene_name[70];
 
 	scene = new Scene();
+	scene_id++;
 
 	if (P3F_scene) {  //Loading a P3F scene
 
 		while (true) {
-			cout << "Input the Scene Name: ";
-			cin >> input_user;
+			if (scene_file != NULL) {
+				strcpy_s(scene_input, sizeof(scene_input), scene_file);
+			}
+			else {
+				cout << "Input the Scene Name: ";
+				cin >> scene_input;
+			}
 			strcpy_s(scene_name, sizeof(scene_name), scenes_dir);
-			strcat_s(scene_name, sizeof(scene_name), input_user);
+			strcat_s(scene_name, sizeof(scene_name), scene_input);
 
 			ifstream file(scene_name, ios::in);
 			if (file.fail()) {
@@ -813,8 +1452,14 @@ void init_scene(void)
 				break;
 		}
 
-		scene->load_p3f(scene_name);
-		printf("Scene loaded.\n\n");
+		auto timeStart = std::chrono::high_resolution_clock::now();
+		if (!scene->load_p3f(scene_name)) {
+			printf("\nError loading P3F file.\n");
+			exit(1);
+		}
+		auto timeEnd = std::chrono::high_resolution_clock::now();
+		auto passedTime = std::chrono::duration<double, std::milli>(timeEnd - timeStart).count();
+		printf("Scene loaded in %.2f (ms).\n\n", passedTime);
 	}
 	else {
 		printf("Creating a Random Scene.\n\n");
@@ -827,37 +1472,31 @@ void init_scene(void)
 	printf("\nResolutionX = %d  ResolutionY= %d.\n", RES_X, RES_Y);
 
 	// Pixel buffer to be used in the Save Image function
-	img_Data = (uint8_t*)malloc(3 * RES_X*RES_Y * sizeof(uint8_t));
-	if (img_Data == NULL) exit(1);
+	size_image = 3 * RES_X*RES_Y * sizeof(float);
+	if (drawModeEnabled) {  //the file mode streams its rows to the image file instead
+		img_Data = (float*)malloc(size_image);
+		if (img_Data == NULL) exit(1);
+	}
+
+	scene_time = 0.0f;  //the accelerator is built over the poses of the animated instances at time 0
+	scene->Animate(scene_time);
 
 	Accel_Struct = scene->GetAccelStruct();   //Type of acceleration data structure
 
 	if (Accel_Struct == GRID_ACC) {
 		grid_ptr = new Grid();
-		vector<Object*> objs;
-		int num_objects = scene->getNumObjects();
-
-		for (int o = 0; o < num_objects; o++) {
-			objs.push_back(scene->getObject(o));
-		}
-		grid_ptr->Build(objs);
+		grid_ptr->Build(scene->getPrimitives(), scene->GetArena());
 		printf("Grid built.\n\n");
 	}
 	else if (Accel_Struct == BVH_ACC) {
-		vector<Object*> objs;
-		int num_objects = scene->getNumObjects();
 		bvh_ptr = new BVH();
-
-		for (int o = 0; o < num_objects; o++) {
-			objs.push_back(scene->getObject(o));
-		}
-		bvh_ptr->Build(objs);
+		bvh_ptr->Build(scene->getPrimitives(), scene->GetArena());
 		printf("BVH built.\n\n");
 	}
 	else
 		printf("No acceleration data structure.\n\n");
 
-	spp = scene->GetSamplesPerPixel();
+	spp = spp_override >= 0 ? spp_override : scene->GetSamplesPerPixel();
 	if (spp == 0) {
 		antialiasing = false;
 		//spp = 1;
@@ -867,7 +1506,57 @@ void init_scene(void)
 		antialiasing = true;
 		printf("Distribution Ray-Tracing\n");
 	}
+	vector<Light*> lights;
+	for (int i = 0; i < scene->getNumLights(); i++) lights.push_back(scene->getLight(i));
+	light_tree.Build(lights, softLights ? Vector(3.0f, 0.0f, 3.0f) : Vector(0.0f, 0.0f, 0.0f));  //the area soft lights sample
+	if (light_samples > 0) printf("%d of the %d lights sampled per hit\n", light_samples, light_tree.GetNumLights());
+	if (scene->GetEnvironment().IsLoaded()) printf("%d directions of the environment map sampled per hit\n", MAX(env_samples, 0));
+
+	printf(VIRTUAL_DISPATCH ? "Virtual primitive dispatch\n" : "Per type primitive dispatch\n");
+
+}
+
+// Scene loader and region renderer of the worker processes of the distributed file mode
+
+bool loadWorkerScene(const char* scene_file)
+{
+	string path = string("P3D_Scenes/") + scene_file;
+	if (ifstream(path.c_str(), ios::in).fail()) {
+		printf("\nError opening P3F file %s.\n", path.c_str());
+		return false;
+	}
+
+	if (scene != NULL) {  //the scene of the previous frames
+		delete(scene);
+		delete(grid_ptr); grid_ptr = NULL;
+		delete(bvh_ptr); bvh_ptr = NULL;
+		free(img_Data); img_Data = NULL;
+	}
+	init_scene(scene_file);
+	return true;
+}
 
+void renderRegion(const TileJob& job, float* pixels)
+{
+	Camera* camera = scene->GetCamera();
+	camera->SetEye(Vector(job.eye[0], job.eye[1], job.eye[2]));
+	spp = job.spp;  //the settings of the coordinator, which may not be those of the scene
+	antialiasing = spp > 0;
+	max_depth = job.max_depth;
+	min_weight = job.min_weight;
+	russian_roulette = job.roulette != 0;
+	light_samples = job.light_samples;
+	env_samples = job.env_samples;
+	updateScene(job.time);
+
+	for (int y = job.y0; y < job.y1; y++) {
+		for (int x = job.x0; x < job.x1; x++) {
+			Color color = renderPixel(camera, x, y);
+			*pixels++ = color.r();
+			*pixels++ = color.g();
+			*pixels++ = color.b();
+		}
+	}
 }
 
 int main(int argc, char* argv[])
@@ -880,6 +1569,62 @@ int main(int argc, char* argv[])
 	}
 	ilInit();
 
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) output_file = argv[++i];
+		else if (strcmp(argv[i], "-resume") == 0) resume_output = true;
+		else if (strcmp(argv[i], "-exposure") == 0 && i + 1 < argc) exposure = (float)atof(argv[++i]);
+		else if (strcmp(argv[i], "-tonemap") == 0 && i + 1 < argc) {
+			if (!ParseToneMap(argv[++i], tonemap)) printf("Unknown tone mapping %s\n", argv[i]);
+		}
+		else if (strcmp(argv[i], "-coordinator") == 0 && i + 1 < argc) {
+			coordinator = new Coordinator();
+			if (!P3F_scene || !coordinator->Listen(atoi(argv[++i]))) {
+				printf("Error starting the coordinator\n");
+				exit(1);
+			}
+			drawModeEnabled = false;
+		}
+		else if (strcmp(argv[i], "-worker") == 0 && i + 1 < argc) {
+			worker_address = argv[++i];
+			drawModeEnabled = false;  //tiles are rendered into the buffers of the jobs
+		}
+		else if (strcmp(argv[i], "-crop") == 0 && i + 4 < argc) {
+			for (int k = 0; k < 4; k++) crop[k] = atoi(argv[++i]);
+			drawModeEnabled = false;
+		}
+		else if (strcmp(argv[i], "-patch") == 0) patch_output = true;
+		else if (strcmp(argv[i], "-depth") == 0 && i + 1 < argc) max_depth = atoi(argv[++i]);
+		else if (strcmp(argv[i], "-min-weight") == 0 && i + 1 < argc) min_weight = (float)atof(argv[++i]);
+		else if (strcmp(argv[i], "-roulette") == 0) russian_roulette = true;
+		else if (strcmp(argv[i], "-light-samples") == 0 && i + 1 < argc) light_samples = atoi(argv[++i]);
+		else if (strcmp(argv[i], "-env-samples") == 0 && i + 1 < argc) env_samples = atoi(argv[++i]);
+		else if (strcmp(argv[i], "-frames") == 0 && i + 1 < argc) {
+			num_frames = atoi(argv[++i]);
+			if (num_frames < 1) num_frames = 1;
+			drawModeEnabled = false;
+		}
+		else if (strcmp(argv[i], "-refit-limit") == 0 && i + 1 < argc) refit_limit = (float)atof(argv[++i]);
+		else if (strcmp(argv[i], "-budget") == 0 && i + 1 < argc) {
+			time_budget = (float)atof(argv[++i]);
+			drawModeEnabled = false;
+		}
+		else if (strcmp(argv[i], "-spp") == 0 && i + 1 < argc) {
+			spp_override = atoi(argv[++i]);
+			if (spp_override < 0) spp_override = 0;
+		}
+	}
+
+	if (worker_address != NULL) {
+		set_rand_seed(time(NULL) * time(NULL));
+		if (!runWorker(worker_address, loadWorkerScene, renderRegion)) {
+			printf("Error connecting to the coordinator at %s\n", worker_address);
+			exit(1);
+		}
+		printShadowCacheStats();
+		printf("Program ended normally\n");
+		exit(EXIT_SUCCESS);
+	}
+
 	int 
 		ch;
 	if (!drawModeEnabled) {
@@ -887,14 +1632,24 @@ int main(int argc, char* argv[])
 		do {
 			init_scene();
 
-			auto timeStart = std::chrono::high_resolution_clock::now();
-			renderScene();  //Just creating an image file
-			auto timeEnd = std::chrono::high_resolution_clock::now();
-			auto passedTime = std::chrono::duration<double, std::milli>(timeEnd - timeStart).count();
-			printf("\nDone: %.2f (sec)\n", passedTime / 1000);
+			const char* image_file = output_file;
+			for (int frame = 0; frame < num_frames; frame++) {
+				string frame_file = num_frames > 1 ? frameFileName(image_file, frame) : string(image_file);
+				output_file = frame_file.c_str();
+				updateScene((float)frame);
+
+				auto timeStart = std::chrono::high_resolution_clock::now();
+				renderScene();  //Just creating an image file
+				auto timeEnd = std::chrono::high_resolution_clock::now();
+				auto passedTime = std::chrono::duration<double, std::milli>(timeEnd - timeStart).count();
+				printf("\nDone: %.2f (sec)\n", passedTime / 1000);
+			}
+			output_file = image_file;
 			if (!P3F_scene) break;
 			cout << "\nPress 'y' to render another image or another key to terminate!\n";
 			delete(scene);
+			delete(grid_ptr); grid_ptr = NULL;
+			delete(bvh_ptr); bvh_ptr = NULL;
 			free(img_Data);
 			ch = _getch();
 		} while((toupper(ch) == 'Y')) ;
@@ -903,21 +1658,13 @@ int main(int argc, char* argv[])
 	else {   //Use OpenGL to draw image in the screen
 		printf("OPENGL DRAWING MODE\n\n");
 		init_scene();
-		size_vertices = 2 * RES_X*RES_Y * sizeof(float);
-		size_colors = 3 * RES_X*RES_Y * sizeof(float);
-		vertices = (float*)malloc(size_vertices);
-		if (vertices == NULL) exit(1);
-		colors = (float*)malloc(size_colors);
-		if (colors == NULL) exit(1);
-		memset(colors, 0, size_colors);
 
 		/* Setup GLUT and GLEW */
 		init(argc, argv);
 		glutMainLoop();
+		stopRenderWorkers();
 	}
 
-	free(colors);
-	free(vertices);
 	printf("Program ended normally\n");
 	exit(EXIT_SUCCESS);
 }
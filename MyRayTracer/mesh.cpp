@@ -0,0 +1,302 @@
+#include <algorithm>
+#include <map>
+
+#include "mesh.h"
+#include "macros.h"
+
+// --------------------------------------------------------------------- memory budget
+bool MemoryBudget::Acquire(size_t bytes)
+{
+	if (cap != 0 && current + bytes > cap) return false;
+	current += bytes;
+	if (current > peak) peak = current;
+	return true;
+}
+
+void MemoryBudget::Release(size_t bytes)
+{
+	current = bytes > current ? 0 : current - bytes;
+}
+
+// --------------------------------------------------------------------- triangle mesh
+//Face with its centroid, only used while the BVH is built so nth_element does not gather vertices
+struct BuildFace
+{
+	MeshFace face;
+	float centroid[3];
+};
+
+class FaceComparator {
+public:
+	int dimension;
+
+	bool operator() (const BuildFace& a, const BuildFace& b) {
+		return a.centroid[dimension] < b.centroid[dimension];
+	}
+};
+
+TriangleMesh::TriangleMesh(void)
+{
+	m_Material = NULL;
+}
+
+//Exact number of nodes of a median split BVH, so the node array is allocated only once
+static size_t count_nodes(size_t n_faces, map<size_t, size_t>& memo)
+{
+	if (n_faces <= MESH_LEAF_SIZE) return 1;
+
+	map<size_t, size_t>::iterator it = memo.find(n_faces);
+	if (it != memo.end()) return it->second;
+
+	size_t count = 1 + count_nodes(n_faces / 2, memo) + count_nodes(n_faces - n_faces / 2, memo);
+	memo[n_faces] = count;
+	return count;
+}
+
+size_t TriangleMesh::NodeCount(size_t n_faces)
+{
+	map<size_t, size_t> memo;
+	return n_faces == 0 ? 0 : count_nodes(n_faces, memo);
+}
+
+size_t TriangleMesh::MemoryFor(size_t n_vertices, size_t n_faces)
+{
+	return n_vertices * sizeof(Vector) + n_faces * sizeof(MeshFace) + NodeCount(n_faces) * sizeof(MeshNode);
+}
+
+size_t TriangleMesh::BuildMemoryFor(size_t n_faces)
+{
+	return n_faces * sizeof(BuildFace);
+}
+
+void TriangleMesh::Build(void)
+{
+	nodes.clear();
+	if (faces.empty()) {
+		bbox = AABB(Vector(0.0f, 0.0f, 0.0f), Vector(0.0f, 0.0f, 0.0f));
+		return;
+	}
+
+	vector<BuildFace> build_faces(faces.size());
+	for (size_t i = 0; i < faces.size(); i++) {
+		Vector& p0 = vertices[faces[i].v[0]];
+		Vector& p1 = vertices[faces[i].v[1]];
+		Vector& p2 = vertices[faces[i].v[2]];
+
+		build_faces[i].face = faces[i];
+		build_faces[i].centroid[0] = p0.x + p1.x + p2.x;  //three times the centroid is enough to sort
+		build_faces[i].centroid[1] = p0.y + p1.y + p2.y;
+		build_faces[i].centroid[2] = p0.z + p1.z + p2.z;
+	}
+
+	nodes.reserve(NodeCount(faces.size()));
+	nodes.push_back(MeshNode());
+	build_recursive(build_faces, 0, 0, faces.size());
+	bbox = AABB(nodes[0].min, nodes[0].max);
+
+	for (size_t i = 0; i < faces.size(); i++)
+		faces[i] = build_faces[i].face;
+}
+
+void TriangleMesh::build_recursive(vector<BuildFace>& build_faces, unsigned int node, unsigned int left_index, unsigned int right_index)
+{
+	Vector min = Vector(FLT_MAX, FLT_MAX, FLT_MAX), max = Vector(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+
+	for (unsigned int i = left_index; i < right_index; i++) {
+		for (int k = 0; k < 3; k++) {
+			Vector& p = vertices[build_faces[i].face.v[k]];
+			if (p.x < min.x) min.x = p.x;
+			if (p.y < min.y) min.y = p.y;
+			if (p.z < min.z) min.z = p.z;
+			if (p.x > max.x) max.x = p.x;
+			if (p.y > max.y) max.y = p.y;
+			if (p.z > max.z) max.z = p.z;
+		}
+	}
+	// enlarge the bounding box a bit just in case... (same as Triangle)
+	min -= EPSILON;
+	max += EPSILON;
+	nodes[node].min = min;
+	nodes[node].max = max;
+
+	if (right_index - left_index <= MESH_LEAF_SIZE) {
+		nodes[node].index = left_index;
+		nodes[node].n_faces = right_index - left_index;
+		nodes[node].axis = 0;
+		return;
+	}
+
+	// median split along the longest axis
+	Vector len = max - min;
+	int dim = (len.x >= len.y && len.x >= len.z) ? 0 : (len.y >= len.z ? 1 : 2);
+	unsigned int split_index = left_index + (right_index - left_index) / 2;
+
+	FaceComparator cmp;
+	cmp.dimension = dim;
+	std::nth_element(build_faces.begin() + left_index, build_faces.begin() + split_index, build_faces.begin() + right_index, cmp);
+
+	unsigned int child = nodes.size();
+	nodes.push_back(MeshNode());
+	nodes.push_back(MeshNode());
+	nodes[node].index = child;
+	nodes[node].n_faces = 0;
+	nodes[node].axis = dim;
+
+	build_recursive(build_faces, child, left_index, split_index);
+	build_recursive(build_faces, child + 1, split_index, right_index);
+}
+
+AABB TriangleMesh::GetBoundingBox(void)
+{
+	return bbox;
+}
+
+//
+// Same Tomas Moller-Ben Trumbore test as Triangle::intercepts, so meshes render identically either way.
+//
+bool TriangleMesh::intersect_face(unsigned int face, Ray& r, float& t)
+{
+	Vector& p0 = vertices[faces[face].v[0]];
+	Vector& p1 = vertices[faces[face].v[1]];
+	Vector& p2 = vertices[faces[face].v[2]];
+
+	Vector edge1 = p1 - p0;
+	Vector edge2 = p2 - p0;
+	Vector ray_cross_edge2 = r.direction % edge2;
+	float det = edge1 * ray_cross_edge2;
+
+	if (r.direction * edge1 == 0) return false;
+
+	float inv_det = 1.0f / det;
+	Vector s = r.origin - p0;
+	float u = s * ray_cross_edge2 * inv_det;
+
+	if (u < 0 || u > 1) return false;
+
+	Vector s_cross_edge1 = s % edge1;
+	float v = r.direction * s_cross_edge1 * inv_det;
+
+	if (v < 0 || u + v > 1) return false;
+
+	t = edge2 * s_cross_edge1 * inv_det;
+	return t >= r.tmin;
+}
+
+static inline bool hit_node(const Vector& min, const Vector& max, const Ray& r, float closest)
+{
+	float tx0 = (min.x - r.origin.x) * r.inv_direction.x, tx1 = (max.x - r.origin.x) * r.inv_direction.x;
+	float ty0 = (min.y - r.origin.y) * r.inv_direction.y, ty1 = (max.y - r.origin.y) * r.inv_direction.y;
+	float tz0 = (min.z - r.origin.z) * r.inv_direction.z, tz1 = (max.z - r.origin.z) * r.inv_direction.z;
+
+	float t0 = MAX3(MIN(tx0, tx1), MIN(ty0, ty1), MIN(tz0, tz1));
+	float t1 = MIN3(MAX(tx0, tx1), MAX(ty0, ty1), MAX(tz0, tz1));
+
+	return t0 <= t1 && t1 >= r.tmin && t0 < closest;
+}
+
+//Face of the last hit reported by intercepts, kept per thread so render threads can share the meshes.
+//The closest hit queries only report hits nearer than any before, so after one it is the face of the mesh that was hit.
+static thread_local unsigned int hit_face = 0;
+
+bool TriangleMesh::intercepts(Ray& r, float& t)
+{
+	unsigned int stack[MESH_STACK_SIZE];
+	int top = 0;
+	float closest = r.tmax, face_t;  //faces at or beyond r.tmax are rejected
+	bool hit = false;
+
+	if (nodes.empty()) return false;
+
+	stack[top++] = 0;
+	while (top > 0) {
+		MeshNode& node = nodes[stack[--top]];
+
+		if (!hit_node(node.min, node.max, r, closest)) continue;
+
+		if (node.n_faces > 0) {
+			for (unsigned int i = node.index; i < node.index + node.n_faces; i++) {
+				if (intersect_face(i, r, face_t) && face_t < closest) {
+					closest = face_t;
+					hit_face = i;
+					hit = true;
+				}
+			}
+		}
+		else if (r.sign[node.axis]) {  //push the far child first so the near one is visited first
+			stack[top++] = node.index;
+			stack[top++] = node.index + 1;
+		}
+		else {
+			stack[top++] = node.index + 1;
+			stack[top++] = node.index;
+		}
+	}
+
+	if (hit) t = closest;
+	return hit;
+}
+
+//Normal of the face found by the last successful intercepts on this thread (same as Triangle's)
+Vector TriangleMesh::getNormal(Vector point)
+{
+	MeshFace& face = faces[hit_face];
+	Vector v0 = vertices[face.v[1]] - vertices[face.v[0]];
+	Vector v1 = vertices[face.v[2]] - vertices[face.v[0]];
+
+	Vector normal = v0 % v1;
+	return normal.normalize();
+}
+
+// --------------------------------------------------------------------- mesh instance
+MeshInstance::MeshInstance(TriangleMesh* a_mesh, const Transform& a_to_world) : mesh(a_mesh), placement(a_to_world)
+{
+	m_Material = NULL;
+	SetTransform(a_to_world);
+}
+
+void MeshInstance::SetTransform(const Transform& a_to_world)
+{
+	to_world = a_to_world;
+	to_object = a_to_world.Inverse();
+
+	//the box around the corners of the one of the mesh, where they end up
+	AABB box = mesh->GetBoundingBox();
+	for (int i = 0; i < 8; i++) {
+		Vector corner = to_world.Point(Vector(i & 1 ? box.max.x : box.min.x, i & 2 ? box.max.y : box.min.y, i & 4 ? box.max.z : box.min.z));
+		if (i == 0) bbox = AABB(corner, corner);
+		else bbox.extend(AABB(corner, corner));
+	}
+}
+
+//Before the first key and after the last one the instance stays at their poses
+void MeshInstance::SetTime(float time)
+{
+	if (keys.empty()) return;
+
+	size_t next = 0;
+	while (next < keys.size() && keys[next].time <= time) next++;
+
+	InstanceKey pose = keys[next == 0 ? 0 : next - 1];
+	if (next > 0 && next < keys.size()) {
+		const InstanceKey& a = keys[next - 1];
+		const InstanceKey& b = keys[next];
+		float f = (time - a.time) / (b.time - a.time);
+		pose.translation = a.translation + (b.translation - a.translation) * f;
+		pose.rotation = a.rotation + (b.rotation - a.rotation) * f;
+		pose.scale = a.scale + (b.scale - a.scale) * f;
+	}
+	SetTransform(Transform::Pose(pose.translation, pose.rotation, pose.scale) * placement);
+}
+
+//The direction is not normalized in the space of the mesh, so the distances along the ray are the same in both spaces
+bool MeshInstance::intercepts(Ray& r, float& t)
+{
+	Ray object_ray(to_object.Point(r.origin), to_object.Direction(r.direction), r.tmin, r.tmax);
+	return mesh->TriangleMesh::intercepts(object_ray, t);
+}
+
+Vector MeshInstance::getNormal(Vector point)
+{
+	Vector normal = to_object.Normal(mesh->TriangleMesh::getNormal(point));
+	return normal.normalize();
+}
@@ -0,0 +1,111 @@
+#ifndef MESH_H
+#define MESH_H
+
+#include <vector>
+using namespace std;
+
+#include "scene.h"
+#include "transform.h"
+
+#define MESH_LEAF_SIZE 4	//maximum number of triangles in a mesh BVH leaf
+#define MESH_STACK_SIZE 64	//median splits keep the mesh BVH depth below log2(triangles) + 1
+
+//Bookkeeping of the bytes used by compact meshes, checked against an optional cap (0 = no cap)
+class MemoryBudget
+{
+public:
+	MemoryBudget(size_t a_cap = 0) : cap(a_cap), current(0), peak(0) {}
+
+	bool Acquire(size_t bytes);
+	void Release(size_t bytes);
+	size_t getCap() { return cap; }
+	size_t getCurrent() { return current; }
+	size_t getPeak() { return peak; }
+
+private:
+	size_t cap, current, peak;
+};
+
+struct MeshFace
+{
+	unsigned int v[3];
+};
+
+struct BuildFace;
+
+//Triangle mesh stored as shared vertex and index arrays with its own BVH over the faces.
+//It is a single Object for the scene accelerators, so no per triangle object is ever created.
+class TriangleMesh : public Object
+{
+	struct MeshNode {
+		Vector min, max;
+		unsigned int index;		// first face if leaf, else left child (right child is index + 1)
+		unsigned char n_faces;	// 0 for inner nodes
+		unsigned char axis;		// split axis of inner nodes
+	};
+
+public:
+	TriangleMesh(void);
+
+	vector<Vector>& getVertices() { return vertices; }
+	vector<MeshFace>& getFaces() { return faces; }
+	size_t getNumFaces() { return faces.size(); }
+
+	static size_t NodeCount(size_t n_faces);
+	static size_t MemoryFor(size_t n_vertices, size_t n_faces);
+	static size_t BuildMemoryFor(size_t n_faces);	//scratch memory only used during Build
+	void Build(void);	//to be called once vertices and faces are filled; reorders the faces
+
+	bool intercepts(Ray& r, float& t);
+	Vector getNormal(Vector point);	//normal of the face hit by the last successful intercepts on the calling thread
+	AABB GetBoundingBox(void);
+
+private:
+	vector<Vector> vertices;
+	vector<MeshFace> faces;
+	vector<MeshNode> nodes;
+	AABB bbox;
+
+	void build_recursive(vector<BuildFace>& build_faces, unsigned int node, unsigned int left_index, unsigned int right_index);
+	bool intersect_face(unsigned int face, Ray& r, float& t);
+};
+
+//Pose of an animated instance at a time: its transform is followed by this scale, the turns about X, Y and Z in turn
+//(degrees) and the move
+struct InstanceKey
+{
+	float time;
+	Vector translation;
+	Vector rotation;
+	float scale;
+};
+
+//A mesh shared by any number of instances, each placing it in the scene by its own affine transform. Rays are taken
+//into the space of the mesh and go down its BVH, which is the bottom level under the scene accelerator: a copy costs
+//the transforms and a bounding box, not the mesh.
+class MeshInstance : public Object
+{
+public:
+	MeshInstance(TriangleMesh* a_mesh, const Transform& a_to_world);
+
+	//Keys, in increasing time, move a rigid instance without touching its mesh; between two keys the pose is interpolated
+	void AddKey(const InstanceKey& key) { keys.push_back(key); }
+	bool IsAnimated() const { return !keys.empty(); }
+	float GetLastKeyTime() const { return keys.empty() ? 0.0f : keys.back().time; }
+	void SetTime(float time);
+
+	bool intercepts(Ray& r, float& t);
+	Vector getNormal(Vector point);	//of the face hit by the last successful intercepts on the calling thread
+	AABB GetBoundingBox(void) { return bbox; }
+
+private:
+	TriangleMesh* mesh;
+	Transform placement;	//of the 'inst' command, before the keys
+	Transform to_world, to_object;
+	AABB bbox;
+	vector<InstanceKey> keys;
+
+	void SetTransform(const Transform& a_to_world);
+};
+
+#endif
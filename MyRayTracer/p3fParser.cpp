@@ -0,0 +1,809 @@
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include <iostream>
+#include <thread>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "p3fParser.h"
+#include "scene.h"
+
+#define MEGABYTE (1024.0 * 1024.0)
+
+////////////////////////////////////////////////////////////////////////////////
+// Memory mapped file.
+//
+MappedFile::MappedFile(void) : data(NULL), size(0)
+{
+#ifdef _WIN32
+	file_handle = INVALID_HANDLE_VALUE;
+	map_handle = NULL;
+#else
+	fd = -1;
+#endif
+}
+
+MappedFile::~MappedFile()
+{
+	Close();
+}
+
+bool MappedFile::Open(const char* name)
+{
+	Close();
+#ifdef _WIN32
+	file_handle = CreateFileA(name, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (file_handle == INVALID_HANDLE_VALUE) return false;
+
+	LARGE_INTEGER file_size;
+	if (!GetFileSizeEx(file_handle, &file_size)) return false;
+	size = (size_t)file_size.QuadPart;
+	if (size == 0) { data = ""; return true; }
+
+	map_handle = CreateFileMappingA(file_handle, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (map_handle == NULL) return false;
+	data = (const char*)MapViewOfFile(map_handle, FILE_MAP_READ, 0, 0, 0);
+#else
+	fd = open(name, O_RDONLY);
+	if (fd < 0) return false;
+
+	struct stat st;
+	if (fstat(fd, &st) != 0) return false;
+	size = (size_t)st.st_size;
+	if (size == 0) { data = ""; return true; }
+
+	void* view = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (view == MAP_FAILED) return false;
+	madvise(view, size, MADV_SEQUENTIAL);
+	data = (const char*)view;
+#endif
+	return data != NULL;
+}
+
+//Drops the pages of an already parsed range from memory; they are read again from the file if touched
+void MappedFile::Release(const char* from, const char* to)
+{
+#ifdef _WIN32
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	size_t page = info.dwPageSize;
+#else
+	size_t page = (size_t)sysconf(_SC_PAGESIZE);
+#endif
+	uintptr_t first = ((uintptr_t)from + page - 1) / page * page;
+	uintptr_t last = (uintptr_t)to / page * page;
+
+	if (size == 0 || first >= last) return;
+#ifdef _WIN32
+	VirtualUnlock((void*)first, last - first);  //unlocking pages which are not locked removes them from the working set
+#else
+	madvise((void*)first, last - first, MADV_DONTNEED);
+#endif
+}
+
+void MappedFile::Close(void)
+{
+#ifdef _WIN32
+	if (data != NULL && size > 0) UnmapViewOfFile(data);
+	if (map_handle != NULL) CloseHandle(map_handle);
+	if (file_handle != INVALID_HANDLE_VALUE) CloseHandle(file_handle);
+	file_handle = INVALID_HANDLE_VALUE;
+	map_handle = NULL;
+#else
+	if (data != NULL && size > 0) munmap((void*)data, size);
+	if (fd >= 0) close(fd);
+	fd = -1;
+#endif
+	data = NULL;
+	size = 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Tokenizer.
+//
+// Numbers are parsed by hand. Decimal mantissas and powers of ten which are both exactly
+// representable give a correctly rounded result with a single multiplication or division,
+// so they match what operator>> produces; any other number falls back to strtof/strtod.
+//
+static const float pow10_float[] = { 1e0f, 1e1f, 1e2f, 1e3f, 1e4f, 1e5f, 1e6f, 1e7f, 1e8f, 1e9f, 1e10f };
+static const double pow10_double[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+	1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+
+static inline bool is_space(char c)
+{
+	return c == ' ' || c == '\n' || c == '\t' || c == '\r' || c == '\v' || c == '\f';
+}
+
+static inline bool is_digit(char c)
+{
+	return (unsigned char)(c - '0') < 10;
+}
+
+static inline bool token_is(const char* token, size_t length, const char* name)
+{
+	return strlen(name) == length && memcmp(token, name, length) == 0;
+}
+
+P3FTokenizer::P3FTokenizer(const char* begin, const char* end_, unsigned int first_line) :
+	cur(begin), end(end_), line(first_line) {}
+
+void P3FTokenizer::SkipSpaces(void)
+{
+	while (cur < end && is_space(*cur)) {
+		if (*cur == '\n') line++;
+		cur++;
+	}
+}
+
+bool P3FTokenizer::NextToken(const char*& token, size_t& length)
+{
+	SkipSpaces();
+	if (cur == end) return false;
+
+	token = cur;
+	while (cur < end && !is_space(*cur)) cur++;
+	length = cur - token;
+	return true;
+}
+
+bool P3FTokenizer::AtEnd(void)
+{
+	SkipSpaces();
+	return cur == end;
+}
+
+void P3FTokenizer::Seek(const char* position, unsigned int a_line)
+{
+	cur = position;
+	line = a_line;
+}
+
+bool P3FTokenizer::ExpectToken(const char* name)
+{
+	const char* token;
+	size_t length;
+
+	return NextToken(token, length) && token_is(token, length, name);
+}
+
+void P3FTokenizer::SkipLine(void)
+{
+	const char* eol = (const char*)memchr(cur, '\n', end - cur);
+	if (eol == NULL) {
+		cur = end;
+		return;
+	}
+	cur = eol + 1;
+	line++;
+}
+
+bool P3FTokenizer::ParseDecimal(const char*& p, bool& negative, uint64_t& mantissa, int& exp10, bool& exact)
+{
+	int digits = 0;
+	bool any_digit = false;
+
+	negative = false; mantissa = 0; exp10 = 0; exact = true;
+
+	if (p < end && (*p == '-' || *p == '+')) negative = (*p++ == '-');
+
+	for (; p < end && is_digit(*p); p++) {
+		any_digit = true;
+		if (digits < 19) {
+			mantissa = mantissa * 10 + (*p - '0');
+			if (mantissa != 0) digits++;
+		}
+		else {
+			exp10++;
+			if (*p != '0') exact = false;
+		}
+	}
+
+	if (p < end && *p == '.') {
+		for (p++; p < end && is_digit(*p); p++) {
+			any_digit = true;
+			if (digits < 19) {
+				mantissa = mantissa * 10 + (*p - '0');
+				if (mantissa != 0) digits++;
+				exp10--;
+			}
+			else if (*p != '0') exact = false;
+		}
+	}
+	if (!any_digit) return false;
+
+	if (p < end && (*p == 'e' || *p == 'E')) {
+		bool exp_negative = false;
+		int exponent = 0;
+
+		p++;
+		if (p < end && (*p == '-' || *p == '+')) exp_negative = (*p++ == '-');
+		if (p == end || !is_digit(*p)) return false;
+		for (; p < end && is_digit(*p); p++)
+			if (exponent < 10000) exponent = exponent * 10 + (*p - '0');
+		exp10 += exp_negative ? -exponent : exponent;
+	}
+
+	//the number must fill the whole token
+	return p == end || is_space(*p);
+}
+
+bool P3FTokenizer::CopyToken(char* buffer, size_t size)
+{
+	const char* token;
+	size_t length;
+
+	if (!NextToken(token, length) || length >= size) return false;
+	memcpy(buffer, token, length);
+	buffer[length] = '\0';
+	return true;
+}
+
+bool P3FTokenizer::ReadFloat(float& f)
+{
+	bool negative, exact;
+	uint64_t mantissa;
+	int exp10;
+
+	SkipSpaces();
+	const char* p = cur;
+	if (ParseDecimal(p, negative, mantissa, exp10, exact) && exact && mantissa <= (1u << 24) && exp10 >= -10 && exp10 <= 10) {
+		float value = (float)mantissa;
+		value = exp10 < 0 ? value / pow10_float[-exp10] : value * pow10_float[exp10];
+		f = negative ? -value : value;
+		cur = p;
+		return true;
+	}
+
+	char buffer[64], *parsed_end;
+	if (!CopyToken(buffer, sizeof(buffer))) return false;
+	f = strtof(buffer, &parsed_end);
+	return *parsed_end == '\0';
+}
+
+bool P3FTokenizer::ReadDouble(double& d)
+{
+	bool negative, exact;
+	uint64_t mantissa;
+	int exp10;
+
+	SkipSpaces();
+	const char* p = cur;
+	if (ParseDecimal(p, negative, mantissa, exp10, exact) && exact && mantissa <= (1ull << 53) && exp10 >= -22 && exp10 <= 22) {
+		double value = (double)mantissa;
+		value = exp10 < 0 ? value / pow10_double[-exp10] : value * pow10_double[exp10];
+		d = negative ? -value : value;
+		cur = p;
+		return true;
+	}
+
+	char buffer[64], *parsed_end;
+	if (!CopyToken(buffer, sizeof(buffer))) return false;
+	d = strtod(buffer, &parsed_end);
+	return *parsed_end == '\0';
+}
+
+//Same semantics as operator>> on an unsigned: a leading minus wraps around
+bool P3FTokenizer::ReadUnsigned(unsigned int& u)
+{
+	bool negative = false;
+	unsigned int value = 0;
+
+	SkipSpaces();
+	const char* p = cur;
+	if (p < end && (*p == '-' || *p == '+')) negative = (*p++ == '-');
+	if (p == end || !is_digit(*p)) return false;
+	for (; p < end && is_digit(*p); p++)
+		value = value * 10 + (*p - '0');
+	if (p < end && !is_space(*p)) return false;
+
+	u = negative ? 0u - value : value;
+	cur = p;
+	return true;
+}
+
+bool P3FTokenizer::ReadVector(Vector& v)
+{
+	return ReadFloat(v.x) && ReadFloat(v.y) && ReadFloat(v.z);
+}
+
+bool P3FTokenizer::ReadColor(Color& c)
+{
+	float r, g, b;
+
+	if (!(ReadFloat(r) && ReadFloat(g) && ReadFloat(b))) return false;
+	c = Color(r, g, b);
+	return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// P3F file parsing.
+//
+static size_t peak_process_memory(void)
+{
+#ifdef _WIN32
+	PROCESS_MEMORY_COUNTERS counters;
+	if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) return 0;
+	return counters.PeakWorkingSetSize;
+#else
+	struct rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage) != 0) return 0;
+	return (size_t)usage.ru_maxrss * 1024;
+#endif
+}
+
+P3FParser::P3FParser(Scene* a_scene) : scene(a_scene), file(NULL), stream_meshes(false), streamed_faces(0), num_instances(0),
+	last_instance(NULL), instanced_faces(0) {}
+
+bool P3FParser::Error(P3FTokenizer& tok, const string& msg)
+{
+	cerr << file_name << "(" << tok.getLine() << "): " << msg << "\n";
+	return false;
+}
+
+bool P3FParser::Parse(const char* name)
+{
+	MappedFile mapped_file;
+	Material* material = NULL;
+	const char* cmd;
+	size_t length;
+
+	file_name = name;
+	if (!mapped_file.Open(name)) {
+		cerr << "Could not open '" << name << "'.\n";
+		return false;
+	}
+	file = &mapped_file;
+
+	P3FTokenizer tok(mapped_file.begin(), mapped_file.end());
+
+	while (tok.NextToken(cmd, length))
+	{
+		if (cmd[0] == '#') {
+			tok.SkipLine();
+		}
+
+		else if (token_is(cmd, length, "accel")) {  //Acceleration data structure
+			unsigned int accel_type;
+
+			if (!tok.ReadUnsigned(accel_type)) return Error(tok, "'accel' expects an acceleration structure type.");
+			scene->SetAccelStruct((accelerator)accel_type);
+		}
+
+		else if (token_is(cmd, length, "spp")) {  //samples per pixel
+			unsigned int spp;
+
+			if (!tok.ReadUnsigned(spp)) return Error(tok, "'spp' expects a number of samples.");
+			scene->SetSamplesPerPixel(spp);
+		}
+
+		else if (token_is(cmd, length, "f")) {  //Material
+			double Kd, Ks, Shine, T, ior;
+			Color cd, cs;
+
+			if (!(tok.ReadColor(cd) && tok.ReadDouble(Kd) && tok.ReadColor(cs) && tok.ReadDouble(Ks) &&
+				tok.ReadDouble(Shine) && tok.ReadDouble(T) && tok.ReadDouble(ior)))
+				return Error(tok, "bad material definition.");
+
+			material = scene->GetArena().materials.New(Material(cd, Kd, cs, Ks, Shine, T, ior));
+		}
+
+		else if (token_is(cmd, length, "s")) {  //Sphere
+			Vector center;
+			float radius;
+			Sphere* sphere;
+
+			if (!(tok.ReadVector(center) && tok.ReadFloat(radius))) return Error(tok, "bad sphere definition.");
+			sphere = scene->addSphere(Sphere(center, radius));
+			if (material) sphere->SetMaterial(material);
+		}
+
+		else if (token_is(cmd, length, "box")) {  //axis aligned box
+			Vector minpoint, maxpoint;
+			aaBox* box;
+
+			if (!(tok.ReadVector(minpoint) && tok.ReadVector(maxpoint))) return Error(tok, "bad box definition.");
+			box = scene->addBox(aaBox(minpoint, maxpoint));
+			if (material) box->SetMaterial(material);
+		}
+
+		else if (token_is(cmd, length, "p")) {  // Polygon: just accepts triangles for now
+			Vector P0, P1, P2;
+			Triangle* triangle;
+			unsigned int total_vertices;
+
+			if (!tok.ReadUnsigned(total_vertices)) return Error(tok, "polygon expects a number of vertices.");
+			if (total_vertices != 3) return Error(tok, "unsupported number of vertices.");
+			if (!(tok.ReadVector(P0) && tok.ReadVector(P1) && tok.ReadVector(P2))) return Error(tok, "bad triangle vertex.");
+
+			triangle = scene->addTriangle(Triangle(P0, P1, P2));
+			if (material) triangle->SetMaterial(material);
+		}
+
+		else if (token_is(cmd, length, "stream")) {  //compact mesh loading with a memory cap in MB (0 = no cap)
+			unsigned int cap;
+
+			if (!tok.ReadUnsigned(cap)) return Error(tok, "'stream' expects a memory cap in MB.");
+			stream_meshes = true;
+			budget = MemoryBudget((size_t)cap * 1024 * 1024);
+		}
+
+		else if (token_is(cmd, length, "mesh")) {
+			if (!ParseMesh(tok, material)) return false;
+		}
+
+		else if (token_is(cmd, length, "proto")) {
+			if (!ParsePrototype(tok)) return false;
+		}
+
+		else if (token_is(cmd, length, "inst")) {
+			if (!ParseInstance(tok, material)) return false;
+		}
+
+		else if (token_is(cmd, length, "key")) {
+			if (!ParseKey(tok)) return false;
+		}
+
+		else if (token_is(cmd, length, "pl")) {  // General Plane
+			Vector P0, P1, P2;
+			Plane* plane;
+
+			if (!(tok.ReadVector(P0) && tok.ReadVector(P1) && tok.ReadVector(P2))) return Error(tok, "bad plane definition.");
+			plane = scene->addPlane(Plane(P0, P1, P2));
+			if (material) plane->SetMaterial(material);
+		}
+
+		else if (token_is(cmd, length, "l")) {  // Need to check light color since by default is white
+			Vector pos;
+			Color color;
+
+			if (!(tok.ReadVector(pos) && tok.ReadColor(color))) return Error(tok, "bad light definition.");
+			scene->addLight(scene->GetArena().lights.New(Light(pos, color)));
+		}
+
+		else if (token_is(cmd, length, "v")) {
+			if (!ParseCamera(tok)) return false;
+		}
+
+		else if (token_is(cmd, length, "bclr")) {  //Background color
+			Color bgcolor;
+
+			if (!tok.ReadColor(bgcolor)) return Error(tok, "bad background color.");
+			scene->SetBackgroundColor(bgcolor);
+		}
+
+		else if (token_is(cmd, length, "env")) {
+			const char* dir;
+			size_t dir_length;
+
+			if (!tok.NextToken(dir, dir_length)) return Error(tok, "'env' expects a skybox directory or an HDR image.");
+			string name(dir, dir_length);
+			size_t dot = name.rfind('.');
+			string ext = dot == string::npos ? "" : name.substr(dot);
+			if (ext == ".hdr" || ext == ".HDR" || ext == ".pfm" || ext == ".PFM") {  //equirectangular environment map
+				if (!scene->GetEnvironment().Load(name.c_str())) return Error(tok, "cannot load the environment map " + name + ".");
+			}
+			else {
+				scene->LoadSkybox(name.c_str());
+				scene->SetSkyBoxFlg(true);
+			}
+		}
+
+		else {
+			return Error(tok, "unknown command '" + string(cmd, length) + "'.");
+		}
+	}
+
+	if (streamed_faces > 0) {
+		printf("Streamed meshes: %u triangles, peak mesh memory %.1f MB", streamed_faces, budget.getPeak() / MEGABYTE);
+		if (budget.getCap() != 0) printf(" (cap %.1f MB)", budget.getCap() / MEGABYTE);
+		printf(", peak process memory %.1f MB\n", peak_process_memory() / MEGABYTE);
+	}
+	if (num_instances > 0) {
+		size_t prototype_faces = 0;
+		for (auto& prototype : prototypes) prototype_faces += prototype.second->getNumFaces();
+		printf("Instances: %u of %u prototype meshes, %zu triangles from %zu stored, %d animated\n", num_instances,
+			(unsigned int)prototypes.size(), instanced_faces, prototype_faces, scene->getNumAnimated());
+	}
+	return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Mesh blocks.
+//
+// Large vertex and face sections are cut at line boundaries into one chunk per thread and
+// parsed in parallel into the preallocated arrays. Every chunk must consume exactly the
+// records assigned to it, which makes the result identical to reading the section serially;
+// otherwise (several records per line, garbage, ...) the section is read again serially,
+// which also reports the line of the error.
+//
+struct MeshChunk
+{
+	const char* begin;
+	const char* end;
+	unsigned int line;	 // line of begin
+	unsigned int first;	 // index of the first record in this chunk
+	unsigned int count;
+	bool ok;
+};
+
+static unsigned int mesh_chunks(unsigned int records)
+{
+	unsigned int n_threads = thread::hardware_concurrency();
+	unsigned int n_chunks = records / MESH_CHUNK_RECORDS;
+
+	if (n_threads == 0) n_threads = 1;
+	return n_chunks < n_threads ? (n_chunks > 0 ? n_chunks : 1) : n_threads;
+}
+
+//Splits the next 'count' non blank lines into 'n_chunks' chunks; returns the end of the last line or NULL
+static const char* split_lines(const char* p, const char* end, unsigned int& line, unsigned int count, unsigned int n_chunks, vector<MeshChunk>& chunks)
+{
+	unsigned int per_chunk = (count + n_chunks - 1) / n_chunks;
+	unsigned int records = 0;
+
+	while (records < count && p < end) {
+		const char* eol = (const char*)memchr(p, '\n', end - p);
+		const char* next = (eol == NULL) ? end : eol + 1;
+		const char* q = p;
+
+		while (q < next && is_space(*q)) q++;
+		if (q < next) {
+			if (records % per_chunk == 0) {
+				if (!chunks.empty()) chunks.back().end = p;
+				MeshChunk chunk = { p, NULL, line, records, 0, false };
+				chunks.push_back(chunk);
+			}
+			chunks.back().count++;
+			records++;
+		}
+		if (eol != NULL) line++;
+		p = next;
+	}
+
+	if (records < count) return NULL;
+	chunks.back().end = p;
+	return p;
+}
+
+template <class Work>
+static bool parse_chunks(vector<MeshChunk>& chunks, Work work)
+{
+	vector<thread> workers;
+	bool ok = true;
+
+	for (size_t c = 1; c < chunks.size(); c++)
+		workers.push_back(thread(work, ref(chunks[c])));
+	work(chunks[0]);
+
+	for (size_t c = 0; c < workers.size(); c++) workers[c].join();
+	for (size_t c = 0; c < chunks.size(); c++) ok = ok && chunks[c].ok;
+	return ok;
+}
+
+//Reads one face and converts it to 0 based indices; returns an error message or NULL
+static const char* read_face(P3FTokenizer& tok, unsigned int total_vertices, unsigned int* face)
+{
+	if (!(tok.ReadUnsigned(face[0]) && tok.ReadUnsigned(face[1]) && tok.ReadUnsigned(face[2]))) return "bad mesh face.";
+
+	if (face[0] > 0) {  //vertex index start at 1
+		face[0] -= 1;
+		face[1] -= 1;
+		face[2] -= 1;
+	}
+	else {  //negative indices are relative to the end of the vertex list
+		face[0] += total_vertices;
+		face[1] += total_vertices;
+		face[2] += total_vertices;
+	}
+	if (face[0] >= total_vertices || face[1] >= total_vertices || face[2] >= total_vertices) return "mesh face index out of range.";
+	return NULL;
+}
+
+//Reads 'count' records with read_record(tokenizer, index), which returns an error message or NULL.
+//When streaming, records are read in batches and the parsed part of the file is dropped from memory.
+template <class ReadRecord>
+bool P3FParser::ReadRecords(P3FTokenizer& tok, unsigned int count, ReadRecord read_record)
+{
+	unsigned int first = 0;
+	const char* error;
+
+	while (first < count) {
+		const char* batch_begin = tok.getPosition();
+		unsigned int batch = count - first;
+		if (stream_meshes && batch > MESH_STREAM_RECORDS) batch = MESH_STREAM_RECORDS;
+
+		unsigned int n_chunks = mesh_chunks(batch);
+		bool parsed = false;
+
+		if (n_chunks > 1) {
+			vector<MeshChunk> chunks;
+			unsigned int line = tok.getLine();
+			const char* section_end = split_lines(tok.getPosition(), tok.getEnd(), line, batch, n_chunks, chunks);
+
+			if (section_end != NULL && parse_chunks(chunks, [first, &read_record](MeshChunk& chunk) {
+					P3FTokenizer chunk_tok(chunk.begin, chunk.end, chunk.line);
+
+					chunk.ok = true;
+					for (unsigned int i = chunk.first; i < chunk.first + chunk.count && chunk.ok; i++)
+						chunk.ok = read_record(chunk_tok, first + i) == NULL;
+					chunk.ok = chunk.ok && chunk_tok.AtEnd();
+				})) {
+				tok.Seek(section_end, line);
+				parsed = true;
+			}
+		}
+
+		for (unsigned int i = first; i < first + batch && !parsed; i++) {
+			if ((error = read_record(tok, i)) != NULL) return Error(tok, error);
+		}
+
+		if (stream_meshes) file->Release(batch_begin, tok.getPosition());
+		first += batch;
+	}
+	return true;
+}
+
+bool P3FParser::ReadMeshVertices(P3FTokenizer& tok, Vector* vertices, unsigned int total_vertices)
+{
+	return ReadRecords(tok, total_vertices, [vertices](P3FTokenizer& t, unsigned int i) -> const char* {
+		return t.ReadVector(vertices[i]) ? NULL : "bad mesh vertex.";
+	});
+}
+
+bool P3FParser::ReadMeshFaces(P3FTokenizer& tok, MeshFace* faces, unsigned int total_faces, unsigned int total_vertices)
+{
+	return ReadRecords(tok, total_faces, [faces, total_vertices](P3FTokenizer& t, unsigned int i) -> const char* {
+		return read_face(t, total_vertices, faces[i].v);
+	});
+}
+
+bool P3FParser::ParseMesh(P3FTokenizer& tok, Material* material)
+{
+	unsigned int total_vertices, total_faces;
+	Triangle* triangle;
+
+	if (!(tok.ReadUnsigned(total_vertices) && tok.ReadUnsigned(total_faces))) return Error(tok, "mesh expects vertex and face counts.");
+	if (stream_meshes) return ParseStreamedMesh(tok, material, total_vertices, total_faces);
+
+	vector<Vector> vertices(total_vertices);
+	vector<MeshFace> faces(total_faces);
+
+	if (!ReadMeshVertices(tok, vertices.data(), total_vertices)) return false;
+	if (!ReadMeshFaces(tok, faces.data(), total_faces, total_vertices)) return false;
+
+	for (unsigned int i = 0; i < total_faces; i++) {
+		triangle = scene->addTriangle(Triangle(vertices[faces[i].v[0]], vertices[faces[i].v[1]], vertices[faces[i].v[2]]));
+		if (material) triangle->SetMaterial(material);
+	}
+	return true;
+}
+
+//Streaming mode: the mesh stays as compact vertex/index arrays with its own BVH, within the memory cap
+bool P3FParser::ParseStreamedMesh(P3FTokenizer& tok, Material* material, unsigned int total_vertices, unsigned int total_faces)
+{
+	TriangleMesh* mesh = scene->addMesh();
+	if (!ReadCompactMesh(tok, mesh, total_vertices, total_faces)) return false;
+
+	if (material) mesh->SetMaterial(material);
+	streamed_faces += total_faces;
+	return true;
+}
+
+//Fills and builds a compact mesh, within the memory cap of streaming
+bool P3FParser::ReadCompactMesh(P3FTokenizer& tok, TriangleMesh* mesh, unsigned int total_vertices, unsigned int total_faces)
+{
+	size_t scratch = TriangleMesh::BuildMemoryFor(total_faces);
+	size_t bytes = TriangleMesh::MemoryFor(total_vertices, total_faces) + scratch;
+
+	if (!budget.Acquire(bytes)) {
+		char msg[128];
+		snprintf(msg, sizeof(msg), "mesh needs %.1f MB, over the stream memory cap of %.1f MB.", bytes / MEGABYTE, budget.getCap() / MEGABYTE);
+		return Error(tok, msg);
+	}
+
+	mesh->getVertices().resize(total_vertices);
+	mesh->getFaces().resize(total_faces);
+
+	if (!ReadMeshVertices(tok, mesh->getVertices().data(), total_vertices)) return false;
+	if (!ReadMeshFaces(tok, mesh->getFaces().data(), total_faces, total_vertices)) return false;
+
+	mesh->Build();
+	budget.Release(scratch);
+	return true;
+}
+
+//'proto <name> <vertices> <faces>' and the records of a mesh block: a compact mesh which is only drawn by the
+//instances that name it, so it is not in the scene otherwise
+bool P3FParser::ParsePrototype(P3FTokenizer& tok)
+{
+	const char* name;
+	size_t name_length;
+	unsigned int total_vertices, total_faces;
+
+	if (!tok.NextToken(name, name_length)) return Error(tok, "'proto' expects a name.");
+	string key(name, name_length);
+	if (prototypes.count(key) != 0) return Error(tok, "prototype '" + key + "' already defined.");
+	if (!(tok.ReadUnsigned(total_vertices) && tok.ReadUnsigned(total_faces))) return Error(tok, "proto expects vertex and face counts.");
+
+	TriangleMesh* mesh = scene->addPrototype();
+	if (!ReadCompactMesh(tok, mesh, total_vertices, total_faces)) return false;
+	prototypes[key] = mesh;
+	return true;
+}
+
+//'inst <name>' and the 3x4 matrix of the transform of the prototype into the scene, row by row (the last column is
+//the translation); the instance gets the current material
+bool P3FParser::ParseInstance(P3FTokenizer& tok, Material* material)
+{
+	const char* name;
+	size_t name_length;
+	float m[12];
+
+	if (!tok.NextToken(name, name_length)) return Error(tok, "'inst' expects a prototype name.");
+	map<string, TriangleMesh*>::iterator prototype = prototypes.find(string(name, name_length));
+	if (prototype == prototypes.end()) return Error(tok, "unknown prototype '" + string(name, name_length) + "'.");
+
+	for (int i = 0; i < 12; i++) {
+		if (!tok.ReadFloat(m[i])) return Error(tok, "bad instance transform.");
+	}
+	Transform to_world(m[0], m[1], m[2], m[3], m[4], m[5], m[6], m[7], m[8], m[9], m[10], m[11]);
+	if (to_world.Determinant() == 0.0f) return Error(tok, "singular instance transform.");
+
+	MeshInstance* instance = scene->addInstance(MeshInstance(prototype->second, to_world));
+	if (material) instance->SetMaterial(material);
+	last_instance = instance;
+	num_instances++;
+	instanced_faces += prototype->second->getNumFaces();
+	return true;
+}
+
+//'key <time> <translation> <rotation> <scale>': pose of the last instance at a time (in frames), after the ones of its
+//previous keys; the rotation is in degrees about X, Y and Z in turn
+bool P3FParser::ParseKey(P3FTokenizer& tok)
+{
+	InstanceKey key;
+
+	if (last_instance == NULL) return Error(tok, "'key' needs an instance before it.");
+	if (!(tok.ReadFloat(key.time) && tok.ReadVector(key.translation) && tok.ReadVector(key.rotation) && tok.ReadFloat(key.scale)))
+		return Error(tok, "bad animation key.");
+	if (last_instance->IsAnimated() && key.time <= last_instance->GetLastKeyTime()) return Error(tok, "keys must be in increasing time.");
+	if (key.scale == 0.0f) return Error(tok, "a key scales the instance to nothing.");
+
+	if (!last_instance->IsAnimated()) scene->addAnimated(last_instance);
+	last_instance->AddKey(key);
+	return true;
+}
+
+bool P3FParser::ParseCamera(P3FTokenizer& tok)
+{
+	Vector up, from, at;
+	float fov, hither;
+	unsigned int xres, yres;
+	float focal_ratio; //ratio beteween the focal distance and the viewplane distance
+	float aperture_ratio; // number of times to be multiplied by the size of a pixel
+
+	if (!(tok.ExpectToken("from") && tok.ReadVector(from))) return Error(tok, "'from' expected.");
+	if (!(tok.ExpectToken("at") && tok.ReadVector(at))) return Error(tok, "'at' expected.");
+	if (!(tok.ExpectToken("up") && tok.ReadVector(up))) return Error(tok, "'up' expected.");
+	if (!(tok.ExpectToken("angle") && tok.ReadFloat(fov))) return Error(tok, "'angle' expected.");
+	if (!(tok.ExpectToken("hither") && tok.ReadFloat(hither))) return Error(tok, "'hither' expected.");
+	if (!(tok.ExpectToken("resolution") && tok.ReadUnsigned(xres) && tok.ReadUnsigned(yres))) return Error(tok, "'resolution' expected.");
+	if (!(tok.ExpectToken("aperture") && tok.ReadFloat(aperture_ratio))) return Error(tok, "'aperture' expected.");
+	if (!(tok.ExpectToken("focal") && tok.ReadFloat(focal_ratio))) return Error(tok, "'focal' expected.");
+
+	// Create Camera
+	scene->SetCamera(new Camera(from, at, up, fov, hither, 100.0 * hither, xres, yres, aperture_ratio, focal_ratio));
+	return true;
+}
@@ -0,0 +1,105 @@
+#ifndef P3F_PARSER_H
+#define P3F_PARSER_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include <stdint.h>
+using namespace std;
+
+#include "vector.h"
+#include "color.h"
+#include "mesh.h"
+
+#define MESH_CHUNK_RECORDS 16384  //minimum number of mesh records per parsing thread
+#define MESH_STREAM_RECORDS 1048576  //mesh records read between releases of the mapped file when streaming
+
+//Read-only view of a whole file mapped into memory
+class MappedFile
+{
+public:
+	MappedFile(void);
+	~MappedFile();
+
+	bool Open(const char* name);
+	void Close(void);
+	void Release(const char* from, const char* to);
+	const char* begin() { return data; }
+	const char* end() { return data + size; }
+	size_t getSize() { return size; }
+
+private:
+	const char* data;
+	size_t size;
+#ifdef _WIN32
+	void* file_handle;
+	void* map_handle;
+#else
+	int fd;
+#endif
+};
+
+//Whitespace separated tokenizer over a memory range which keeps track of the current line
+class P3FTokenizer
+{
+public:
+	P3FTokenizer(const char* begin, const char* end, unsigned int first_line = 1);
+
+	bool NextToken(const char*& token, size_t& length);  //false at end of input
+	bool ExpectToken(const char* name);
+	void SkipLine(void);
+	bool AtEnd(void);
+	void Seek(const char* position, unsigned int a_line);
+
+	bool ReadFloat(float& f);
+	bool ReadDouble(double& d);
+	bool ReadUnsigned(unsigned int& u);
+	bool ReadVector(Vector& v);
+	bool ReadColor(Color& c);
+
+	unsigned int getLine() { return line; }
+	const char* getPosition() { return cur; }
+	const char* getEnd() { return end; }
+
+private:
+	const char* cur;
+	const char* end;
+	unsigned int line;
+
+	void SkipSpaces(void);
+	bool ParseDecimal(const char*& p, bool& negative, uint64_t& mantissa, int& exp10, bool& exact);
+	bool CopyToken(char* buffer, size_t size);
+};
+
+class P3FParser
+{
+public:
+	P3FParser(Scene* a_scene);
+	bool Parse(const char* name);
+
+private:
+	Scene* scene;
+	string file_name;
+	MappedFile* file;
+	bool stream_meshes;			//mesh blocks become compact TriangleMesh objects
+	MemoryBudget budget;		//memory used by streamed meshes
+	unsigned int streamed_faces;
+	map<string, TriangleMesh*> prototypes;	//meshes declared by 'proto', by name, for 'inst'
+	unsigned int num_instances;
+	MeshInstance* last_instance;	//the one the keys that follow it animate
+	size_t instanced_faces;		//faces of the prototypes of all the instances
+
+	bool Error(P3FTokenizer& tok, const string& msg);
+	bool ParseMesh(P3FTokenizer& tok, Material* material);
+	bool ParseStreamedMesh(P3FTokenizer& tok, Material* material, unsigned int total_vertices, unsigned int total_faces);
+	bool ParsePrototype(P3FTokenizer& tok);
+	bool ParseInstance(P3FTokenizer& tok, Material* material);
+	bool ParseKey(P3FTokenizer& tok);
+	bool ReadCompactMesh(P3FTokenizer& tok, TriangleMesh* mesh, unsigned int total_vertices, unsigned int total_faces);
+	bool ReadMeshVertices(P3FTokenizer& tok, Vector* vertices, unsigned int total_vertices);
+	bool ReadMeshFaces(P3FTokenizer& tok, MeshFace* faces, unsigned int total_faces, unsigned int total_vertices);
+	template <class ReadRecord> bool ReadRecords(P3FTokenizer& tok, unsigned int count, ReadRecord read_record);
+	bool ParseCamera(P3FTokenizer& tok);
+};
+
+#endif
@@ -0,0 +1,174 @@
+#ifndef PRIMITIVE_H
+#define PRIMITIVE_H
+
+#include "scene.h"
+#include "mesh.h"
+
+//Set to 1 to dispatch through the Object virtual functions, to compare against the per type dispatch
+#ifndef VIRTUAL_DISPATCH
+#define VIRTUAL_DISPATCH 0
+#endif
+
+//
+// The switches below call the concrete classes directly, so the intersection code can be inlined
+// into the accelerator loops (with whole program optimization) instead of going through the vtable.
+//
+inline Object* SceneArena::getObject(PrimRef p)
+{
+	switch (p.type) {
+	case SPHERE_PRIM: return spheres.get(p.index);
+	case TRIANGLE_PRIM: return triangles.get(p.index);
+	case BOX_PRIM: return boxes.get(p.index);
+	case PLANE_PRIM: return planes.get(p.index);
+	case MESH_PRIM: return meshes.get(p.index);
+	case INSTANCE_PRIM: return instances.get(p.index);
+	}
+	return NULL;
+}
+
+inline bool SceneArena::intercepts(PrimRef p, Ray& r, float& t)
+{
+#if VIRTUAL_DISPATCH
+	return getObject(p)->intercepts(r, t);
+#else
+	switch (p.type) {
+	case SPHERE_PRIM: return spheres.get(p.index)->Sphere::intercepts(r, t);
+	case TRIANGLE_PRIM: return triangles.get(p.index)->Triangle::intercepts(r, t);
+	case BOX_PRIM: return boxes.get(p.index)->aaBox::intercepts(r, t);
+	case PLANE_PRIM: return planes.get(p.index)->Plane::intercepts(r, t);
+	case MESH_PRIM: return meshes.get(p.index)->TriangleMesh::intercepts(r, t);
+	case INSTANCE_PRIM: return instances.get(p.index)->MeshInstance::intercepts(r, t);
+	}
+	return false;
+#endif
+}
+
+inline Vector SceneArena::getNormal(PrimRef p, Vector point)
+{
+#if VIRTUAL_DISPATCH
+	return getObject(p)->getNormal(point);
+#else
+	switch (p.type) {
+	case SPHERE_PRIM: return spheres.get(p.index)->Sphere::getNormal(point);
+	case TRIANGLE_PRIM: return triangles.get(p.index)->Triangle::getNormal(point);
+	case BOX_PRIM: return boxes.get(p.index)->aaBox::getNormal(point);
+	case PLANE_PRIM: return planes.get(p.index)->Plane::getNormal(point);
+	case MESH_PRIM: return meshes.get(p.index)->TriangleMesh::getNormal(point);
+	case INSTANCE_PRIM: return instances.get(p.index)->MeshInstance::getNormal(point);
+	}
+	return Vector(0.0f, 0.0f, 0.0f);
+#endif
+}
+
+inline AABB SceneArena::GetBoundingBox(PrimRef p)
+{
+#if VIRTUAL_DISPATCH
+	return getObject(p)->GetBoundingBox();
+#else
+	switch (p.type) {
+	case SPHERE_PRIM: return spheres.get(p.index)->Sphere::GetBoundingBox();
+	case TRIANGLE_PRIM: return triangles.get(p.index)->Triangle::GetBoundingBox();
+	case BOX_PRIM: return boxes.get(p.index)->aaBox::GetBoundingBox();
+	case PLANE_PRIM: return planes.get(p.index)->Plane::GetBoundingBox();
+	case MESH_PRIM: return meshes.get(p.index)->TriangleMesh::GetBoundingBox();
+	case INSTANCE_PRIM: return instances.get(p.index)->MeshInstance::GetBoundingBox();
+	}
+	return AABB();
+#endif
+}
+
+//
+// Kernels over the whole array of one primitive type, used when there is no accelerator: every call
+// in the loop goes to the same concrete intercepts, so there is no per primitive dispatch at all.
+//
+//r.tmax is shrunk to each closer hit, so the remaining primitives reject anything beyond it early
+template <class T>
+inline void closest_of_type(Arena<T>& pool, PrimType type, Ray& r, PrimRef& hit_prim, bool& hit)
+{
+	float t;
+	size_t n = pool.getCount();
+
+	for (size_t i = 0; i < n; i++) {
+#if VIRTUAL_DISPATCH
+		if (pool.get(i)->intercepts(r, t)) {
+#else
+		if (pool.get(i)->T::intercepts(r, t)) {
+#endif
+			r.tmax = t;
+			hit_prim = PrimRef(type, i);
+			hit = true;
+		}
+	}
+}
+
+template <class T>
+inline bool any_of_type(Arena<T>& pool, PrimType type, Ray& r, PrimRef* occluder)
+{
+	float t;
+	size_t n = pool.getCount();
+
+	for (size_t i = 0; i < n; i++) {
+#if VIRTUAL_DISPATCH
+		if (pool.get(i)->intercepts(r, t)) {
+#else
+		if (pool.get(i)->T::intercepts(r, t)) {
+#endif
+			if (occluder != NULL) *occluder = PrimRef(type, i);
+			return true;
+		}
+	}
+	return false;
+}
+
+inline bool SceneArena::Closest(Ray& r, PrimRef& hit_prim, float& t)
+{
+	bool hit = false;
+
+	closest_of_type(spheres, SPHERE_PRIM, r, hit_prim, hit);
+	closest_of_type(triangles, TRIANGLE_PRIM, r, hit_prim, hit);
+	closest_of_type(boxes, BOX_PRIM, r, hit_prim, hit);
+	closest_of_type(planes, PLANE_PRIM, r, hit_prim, hit);
+	closest_of_type(meshes, MESH_PRIM, r, hit_prim, hit);
+	closest_of_type(instances, INSTANCE_PRIM, r, hit_prim, hit);
+
+	if (hit) t = r.tmax;
+	return hit;
+}
+
+inline bool SceneArena::Occluded(Ray& r, PrimRef* occluder)
+{
+	return any_of_type(spheres, SPHERE_PRIM, r, occluder) || any_of_type(triangles, TRIANGLE_PRIM, r, occluder) ||
+		any_of_type(boxes, BOX_PRIM, r, occluder) || any_of_type(planes, PLANE_PRIM, r, occluder) ||
+		any_of_type(meshes, MESH_PRIM, r, occluder) || any_of_type(instances, INSTANCE_PRIM, r, occluder);
+}
+
+//Linear tests over a short list, used for the unbounded primitives that are kept out of the accelerators
+inline bool SceneArena::ClosestIn(const vector<PrimRef>& list, Ray& r, PrimRef& hit_prim)
+{
+	float t;
+	bool hit = false;
+
+	for (PrimRef p : list) {
+		if (intercepts(p, r, t)) {
+			r.tmax = t;
+			hit_prim = p;
+			hit = true;
+		}
+	}
+	return hit;
+}
+
+inline bool SceneArena::OccludedIn(const vector<PrimRef>& list, Ray& r, PrimRef* occluder)
+{
+	float t;
+
+	for (PrimRef p : list) {
+		if (intercepts(p, r, t)) {
+			if (occluder != NULL) *occluder = p;
+			return true;
+		}
+	}
+	return false;
+}
+
+#endif
@@ -3,12 +3,24 @@
 
 #include "vector.h"
 
+//The inverse direction and its signs are computed once here and used by every slab test;
+//create a new Ray instead of changing the direction of an existing one.
 class Ray
 {
 public:
-	Ray(const Vector& o, const Vector& dir ) : origin(o), direction(dir) {};
+	Ray(const Vector& o, const Vector& dir, float a_tmin = 0.0f, float a_tmax = FLT_MAX) :
+		origin(o), direction(dir), inv_direction(1.0f / dir.x, 1.0f / dir.y, 1.0f / dir.z), tmin(a_tmin), tmax(a_tmax), spread(0.0f)
+	{
+		sign[0] = inv_direction.x < 0.0f;
+		sign[1] = inv_direction.y < 0.0f;
+		sign[2] = inv_direction.z < 0.0f;
+	};
 
 	Vector origin;
 	Vector direction;
+	Vector inv_direction;
+	int sign[3];		// 1 if the direction is negative along the axis
+	float tmin, tmax;	// valid interval of the ray parameter
+	float spread;		// angle of the cone of directions the ray stands for (a pixel's for primary rays), to filter what it sees
 };
-#endif
\ No newline at end of file
+#endif
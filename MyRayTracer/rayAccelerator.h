@@ -5,25 +5,31 @@
 #include <queue>
 #include <cmath>
 #include "scene.h"
+#include "primitive.h"
 
 using namespace std;
 
+#define BVH_STACK_SIZE 128	//traversal stack: one entry per level at most
+#define BVH_MEDIAN_DEPTH (BVH_STACK_SIZE - 32)	//from this depth on only median splits, which end within 30 levels (PrimRef has 29 index bits)
+#define BVH_REFIT_LIMIT 2.0f	//growth of the node box areas from the build up to which a refit BVH is kept
+
 class Grid
 {
 public:
 	Grid(void);
 	//~Grid(void);
 	int getNumObjects();
-	void addObject(Object* o);
+	void addObject(PrimRef p);
 	void setAABB(AABB& bbox_);
-	Object* getObject(unsigned int index);
-	void Build(vector<Object*>& objs);   // set up grid cells
-	bool Traverse(Ray& ray, Object **hitobject, Vector& hitpoint);  //(const Ray& ray, double& tmin, ShadeRec& sr)
-	bool Traverse(Ray& ray);  //Traverse for shadow ray
+	PrimRef getObject(unsigned int index);
+	void Build(vector<PrimRef>& objs, SceneArena& arena);   // set up grid cells
+	bool Traverse(Ray& ray, PrimRef& hitobject, Vector& hitpoint);  //(const Ray& ray, double& tmin, ShadeRec& sr)
+	bool Traverse(Ray& ray, PrimRef* occluder = NULL);  //Traverse for shadow ray; occluder gets the primitive found
 
 private:
-	vector<Object *> objects;
-	vector<vector<Object*> > cells;
+	SceneArena* arena;
+	vector<PrimRef> objects;
+	vector<vector<PrimRef> > cells;
 
 	int nx, ny, nz; // number of cells in the x, y, and z directions
 	float m = 2.0f; // factor that allows to vary the number of cells
@@ -41,10 +47,11 @@ class BVH
 	class Comparator {
 	public:
 		int dimension;
+		SceneArena* arena;
 
-		bool operator() (Object* a, Object* b) {
-			float ca = a->GetBoundingBox().centroid().getAxisValue(dimension);
-			float cb = b->GetBoundingBox().centroid().getAxisValue(dimension);
+		bool operator() (PrimRef a, PrimRef b) {
+			float ca = arena->GetBoundingBox(a).centroid().getAxisValue(dimension);
+			float cb = arena->GetBoundingBox(b).centroid().getAxisValue(dimension);
 			return ca < cb;
 		}
 	};
@@ -55,7 +62,7 @@ class BVH
 		bool leaf;
 		unsigned int n_objs;
 		unsigned int index;	// if leaf == false: index to left child node,
-							// else if leaf == true: index to first Intersectable (Object *) in objects vector
+							// else if leaf == true: index to first primitive (PrimRef) in objects vector
 
 	public:
 		BVHNode(void);
@@ -70,25 +77,31 @@ class BVH
 
 private:
 	int Threshold = 2;
-	vector<Object*> objects;
+	SceneArena* arena;
+	vector<PrimRef> objects;
 	vector<BVH::BVHNode*> nodes;
+	float build_area;	//sum of the surface areas of the node boxes after Build
 
+	//each traversal keeps its own stack of nodes to visit, so render threads can share the BVH
 	struct StackItem {
 		BVHNode* ptr;
 		float t;
+		StackItem() { }
 		StackItem(BVHNode* _ptr, float _t) : ptr(_ptr), t(_t) { }
 	};
 
-	stack<StackItem> hit_stack;
-
 public:
 	BVH(void);
+	~BVH(void);
 	int getNumObjects();
 	
-	void Build(vector<Object*>& objects);
-	void build_recursive(int left_index, int right_index, BVHNode* node);
-	bool Traverse(Ray& ray, Object** hit_obj, Vector& hit_point);
-	bool Traverse(Ray& ray);
+	void Build(vector<PrimRef>& objects, SceneArena& arena);
+	void build_recursive(int left_index, int right_index, BVHNode* node, int depth = 0);
+	//Boxes of the nodes again from the boxes of the primitives, which moved, keeping the tree; returns the sum of the
+	//areas of the boxes relative to the one after Build, which grows as the tree fits the primitives worse
+	float Refit(void);
+	bool Traverse(Ray& ray, PrimRef& hit_obj, Vector& hit_point);
+	bool Traverse(Ray& ray, PrimRef* occluder = NULL);
 	int findSplitIndex(int dim, int left_index, int right_index, float split_value);
 	int findMedianSplitIndex(int left_index, int right_index);
 };
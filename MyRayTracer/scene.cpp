@@ -1,13 +1,15 @@
 #include <iostream>
 #include <string>
-#include <fstream>
 
 #include "maths.h"
 #include "scene.h"
+#include "p3fParser.h"
+#include "mesh.h"
+#include "primitive.h"
 #include "macros.h"
 
 
-Triangle::Triangle(Vector& P0, Vector& P1, Vector& P2)
+Triangle::Triangle(const Vector& P0, const Vector& P1, const Vector& P2)
 {
 	points[0] = P0; points[1] = P1; points[2] = P2;
 
@@ -78,18 +80,18 @@ bool Triangle::intercepts(Ray& r, float& t ) {
 	//Calculate t
 	t = edge2 * s_cross_edge1 * inv_det;
 
-	if (t < 0.0f) {
+	if (t < r.tmin || t >= r.tmax) {
 		return false;
 	}
 
 	return true;
 }
 
-Plane::Plane(Vector& a_PN, float a_D)
+Plane::Plane(const Vector& a_PN, float a_D)
 	: PN(a_PN), D(a_D)
 {}
 
-Plane::Plane(Vector& P0, Vector& P1, Vector& P2)
+Plane::Plane(const Vector& P0, const Vector& P1, const Vector& P2)
 {
    float l;
 
@@ -122,7 +124,7 @@ bool Plane::intercepts( Ray& r, float& t )
 
 	t = - (PN * r.origin + D) / (PN * r.direction);
 
-	if (t < 0.0f) return false;
+	if (t < r.tmin || t >= r.tmax) return false;
 
 	return true;
 }
@@ -145,8 +147,12 @@ bool Sphere::intercepts(Ray& r, float& t )
 		float disc = b * b - c;
 		if(disc <= 0.0f) return false;
 	}
-	t = (c > 0.0f ? b - sqrt(powf(b, 2) - c) : b + sqrt(powf(b, 2) - c));
-	return true;
+	float root = sqrt(powf(b, 2) - c);
+
+	//nearest root inside the ray interval: the entering one from outside, the leaving one from inside or when the entering one is before tmin
+	t = b - root;
+	if (c <= 0.0f || t < r.tmin) t = b + root;
+	return t >= r.tmin && t < r.tmax;
 }
 
 
@@ -168,7 +174,7 @@ AABB Sphere::GetBoundingBox() {
 	return(AABB(a_min, a_max));
 }
 
-aaBox::aaBox(Vector& minPoint, Vector& maxPoint) //Axis aligned Box: another geometric object
+aaBox::aaBox(const Vector& minPoint, const Vector& maxPoint) //Axis aligned Box: another geometric object
 {
 	this->min = minPoint;
 	this->max = maxPoint;
@@ -180,77 +186,37 @@ AABB aaBox::GetBoundingBox() {
 
 bool aaBox::intercepts(Ray& ray, float& t)
 {
-	//TODO: PUT HERE YOUR CODE
-	double tx_min, ty_min, tz_min;
-	double tx_max, ty_max, tz_max;
-
-	double a = 1.0f / ray.direction.x;
-	if (a >= 0) {
-		tx_min = (this->min.x - ray.origin.x) * a;
-		tx_max = (this->max.x - ray.origin.x) * a;
-	}
-	else {
-		tx_min = (this->max.x - ray.origin.x) * a;
-		tx_max = (this->min.x - ray.origin.x) * a;
-	}
-
-	double b = 1.0f / ray.direction.y;
-	if (b >= 0) {
-		ty_min = (this->min.y - ray.origin.y) * b;
-		ty_max = (this->max.y - ray.origin.y) * b;
-	}
-	else {
-		ty_min = (this->max.y - ray.origin.y) * b;
-		ty_max = (this->min.y - ray.origin.y) * b;
-	}
-
-	double c = 1.0f / ray.direction.z;
-	if (c >= 0) {
-		tz_min = (this->min.z - ray.origin.z) * c;
-		tz_max = (this->max.z - ray.origin.z) * c;
-	}
-	else {
-		tz_min = (this->max.z - ray.origin.z) * c;
-		tz_max = (this->min.z - ray.origin.z) * c;
-	}
+	//branchless slab test with the precomputed inverse direction
+	double tx_min = ((ray.sign[0] ? max.x : min.x) - ray.origin.x) * (double)ray.inv_direction.x;
+	double tx_max = ((ray.sign[0] ? min.x : max.x) - ray.origin.x) * (double)ray.inv_direction.x;
+	double ty_min = ((ray.sign[1] ? max.y : min.y) - ray.origin.y) * (double)ray.inv_direction.y;
+	double ty_max = ((ray.sign[1] ? min.y : max.y) - ray.origin.y) * (double)ray.inv_direction.y;
+	double tz_min = ((ray.sign[2] ? max.z : min.z) - ray.origin.z) * (double)ray.inv_direction.z;
+	double tz_max = ((ray.sign[2] ? min.z : max.z) - ray.origin.z) * (double)ray.inv_direction.z;
 
 	float tE, tL;
-	Vector face_in, face_out;
 
-	if (tx_min > ty_min) {
+	if (tx_min > ty_min)
 		tE = tx_min;
-		face_in = (a >= 0.0f) ? Vector(-1, 0, 0) : Vector(1, 0, 0);
-	}
-	else {
+	else
 		tE = ty_min;
-		face_in = (b >= 0.0f) ? Vector(0, -1, 0) : Vector(0, 1, 0);
-	}
-	if (tz_min > tE) {
+	if (tz_min > tE)
 		tE = tz_min;
-		face_in = (c >= 0.0f) ? Vector(0, 0, -1) : Vector(0, 0, 1);
-	}
 
-	if (tx_max < ty_max) {
+	if (tx_max < ty_max)
 		tL = tx_max;
-		face_out = (a >= 0.0f) ? Vector(1, 0, 0) : Vector(-1, 0, 0);
-	}
-	else {
+	else
 		tL = ty_max;
-		face_out = (b >= 0.0f) ? Vector(0, 1, 0) : Vector(0, -1, 0);
-	}
-	if (tz_max < tL) {
+	if (tz_max < tL)
 		tL = tz_max;
-		face_out = (c >= 0.0f) ? Vector(0, 0, 1) : Vector(0, 0, -1);
-	}
 
-	if (tE < tL && tL > 0) {
-		if (tE > 0.0f) {
+	if (tE < tL && tL > ray.tmin && tE < ray.tmax) {
+		if (tE > ray.tmin) {
 			t = tE;
-			Normal = face_in;
 		}
 		else {
+			if (tL >= ray.tmax) return false;
 			t = tL;
-			Normal = face_out;
 		}
 		return (true);
 	}
@@ -258,40 +224,107 @@ bool aaBox::intercepts(Ray& ray, float& t)
 	return (false);
 }
 
+//Outward normal of the face nearest to the point, so nothing is kept from intercepts and concurrent rays can share the box
 Vector aaBox::getNormal(Vector point)
 {
-	return Normal;
+	float d[6] = { fabsf(point.x - min.x), fabsf(point.x - max.x), fabsf(point.y - min.y),
+		fabsf(point.y - max.y), fabsf(point.z - min.z), fabsf(point.z - max.z) };
+	int face = 0;
+
+	for (int i = 1; i < 6; i++)
+		if (d[i] < d[face]) face = i;
+
+	switch (face) {
+	case 0: return Vector(-1, 0, 0);
+	case 1: return Vector(1, 0, 0);
+	case 2: return Vector(0, -1, 0);
+	case 3: return Vector(0, 1, 0);
+	case 4: return Vector(0, 0, -1);
+	default: return Vector(0, 0, 1);
+	}
 }
 
-Scene::Scene()
+//Defined here, where TriangleMesh is complete, so its arena can run the mesh destructors
+SceneArena::SceneArena()
+{}
+
+SceneArena::~SceneArena()
 {}
 
+Scene::Scene() : camera(NULL)
+{
+	for (int i = 0; i < 6; i++) skybox_num_levels[i] = 0;
+}
+
 Scene::~Scene()
 {
-	/*for ( int i = 0; i < objects.size(); i++ )
-	{
-		delete objects[i];
-	}
-	objects.erase();
-	*/
+	//objects, materials and lights are owned by the arena
+	delete camera;
 }
 
 int Scene::getNumObjects()
 {
-	return objects.size();
+	return prims.size() + unbounded.size();
+}
+
+
+//Copies a primitive into the arena array of its type and references it in the scene
+template <class T>
+static T* add_primitive(vector<PrimRef>& prims, Arena<T>& pool, PrimType type, const T& obj)
+{
+	prims.push_back(PrimRef(type, pool.getCount()));
+	return pool.New(obj);
+}
+
+Sphere* Scene::addSphere(const Sphere& s)
+{
+	return add_primitive(prims, arena.spheres, SPHERE_PRIM, s);
+}
+
+Triangle* Scene::addTriangle(const Triangle& t)
+{
+	return add_primitive(prims, arena.triangles, TRIANGLE_PRIM, t);
+}
+
+aaBox* Scene::addBox(const aaBox& b)
+{
+	return add_primitive(prims, arena.boxes, BOX_PRIM, b);
+}
+
+//Planes have no bounding box, so they are kept apart from the primitives given to the accelerators
+Plane* Scene::addPlane(const Plane& p)
+{
+	return add_primitive(unbounded, arena.planes, PLANE_PRIM, p);
 }
 
+TriangleMesh* Scene::addMesh(void)
+{
+	prims.push_back(PrimRef(MESH_PRIM, arena.meshes.getCount()));
+	return arena.meshes.New();
+}
 
-void Scene::addObject(Object* o)
+TriangleMesh* Scene::addPrototype(void)
 {
-	objects.push_back(o);
+	return arena.prototypes.New();
+}
+
+MeshInstance* Scene::addInstance(const MeshInstance& i)
+{
+	return add_primitive(prims, arena.instances, INSTANCE_PRIM, i);
+}
+
+void Scene::Animate(float time)
+{
+	for (MeshInstance* instance : animated) instance->SetTime(time);
 }
 
 
 Object* Scene::getObject(unsigned int index)
 {
-	if (index >= 0 && index < objects.size())
-		return objects[index];
+	if (index < prims.size())
+		return arena.getObject(prims[index]);
+	if (index < prims.size() + unbounded.size())
+		return arena.getObject(unbounded[index - prims.size()]);
 	return NULL;
 }
 
@@ -353,26 +386,53 @@ void Scene::LoadSkybox(const char *sky_dir)
 
 		ilConvertImage(format, IL_UNSIGNED_BYTE);
 
-		int size = ilGetInteger(IL_IMAGE_SIZE_OF_DATA);
-		skybox_img[i].img = (ILubyte *)malloc(size);
+		int bytesperpixel = format == IL_RGB ? 3 : 4;
+		int width = ilGetInteger(IL_IMAGE_WIDTH);
+		int height = ilGetInteger(IL_IMAGE_HEIGHT);
 		ILubyte *bytes = ilGetData();
-		memcpy(skybox_img[i].img, bytes, size);
-		skybox_img[i].resX = ilGetInteger(IL_IMAGE_WIDTH);
-		skybox_img[i].resY = ilGetInteger(IL_IMAGE_HEIGHT);
-		format == IL_RGB ? skybox_img[i].BPP = 3 : skybox_img[i].BPP = 4;
+
+		SkyboxLevel level = { skybox_texels.size(), width, height };
+		skybox_levels[i][0] = level;
+		skybox_num_levels[i] = 1;
+		for (int p = 0; p < width * height; p++)
+			for (int c = 0; c < 3; c++) skybox_texels.push_back(u8tofloat(bytes[p * bytesperpixel + c]));
+
+		//MIP levels: each the 2x2 box filtered half of the previous one, the last texel of an odd side repeated
+		while ((level.resX > 1 || level.resY > 1) && skybox_num_levels[i] < SKYBOX_MAX_LEVELS) {
+			SkyboxLevel prev = level;
+			level.offset = skybox_texels.size();
+			level.resX = MAX(prev.resX / 2, 1);
+			level.resY = MAX(prev.resY / 2, 1);
+			skybox_texels.resize(level.offset + 3 * level.resX * level.resY);
+			for (int y = 0; y < level.resY; y++) {
+				int y0 = MIN(2 * y, prev.resY - 1), y1 = MIN(2 * y + 1, prev.resY - 1);
+				for (int x = 0; x < level.resX; x++) {
+					int x0 = MIN(2 * x, prev.resX - 1), x1 = MIN(2 * x + 1, prev.resX - 1);
+					for (int c = 0; c < 3; c++) {
+						const float *src = &skybox_texels[prev.offset + c];
+						skybox_texels[level.offset + 3 * (y * level.resX + x) + c] = 0.25f *
+							(src[3 * (y0 * prev.resX + x0)] + src[3 * (y0 * prev.resX + x1)] +
+							 src[3 * (y1 * prev.resX + x0)] + src[3 * (y1 * prev.resX + x1)]);
+					}
+				}
+			}
+			skybox_levels[i][skybox_num_levels[i]++] = level;
+		}
+		printf("Skybox face %d: %dx%d, %d MIP levels\n", i, width, height, skybox_num_levels[i]);
+
 		ilDeleteImages(1, &ImageName);
+		free(filenames[i]);
 	}
 	ilDisable(IL_ORIGIN_SET);
 }
 
-Color Scene::GetSkyboxColor(Ray& r) {
+Color Scene::GetSkyboxColor(const Ray& r) {
 	float t_intersec;
 	Vector cubemap_coords; //To index the skybox
 
 	float ma;
 	CubeMap img_side;
 	float sc, tc, s, t;
-	unsigned int xp, yp, width, height, bytesperpixel;
 
 	//skybox indexed by the ray direction
 	cubemap_coords = r.direction;
@@ -429,235 +489,58 @@ Color Scene::GetSkyboxColor(Ray& r) {
 	s = (sc * invMa + 1) / 2;
 	t = (tc * invMa + 1) / 2;
 
-	width = skybox_img[img_side].resX;
-	height = skybox_img[img_side].resY;
-	bytesperpixel = skybox_img[img_side].BPP;
-
-	xp = int((width - 1) * s);
-	xp < 0 ? 0 : (xp > (width - 1) ? width - 1 : xp);
-	yp = int((height - 1) * t);
-	yp < 0 ? 0 : (yp > (height - 1) ? height - 1 : yp);
-
-	float red = u8tofloat(skybox_img[img_side].img[(yp*width + xp) * bytesperpixel]);
-	float green = u8tofloat(skybox_img[img_side].img[(yp*width + xp) * bytesperpixel + 1]);
-	float blue = u8tofloat(skybox_img[img_side].img[(yp*width + xp) * bytesperpixel + 2]);
+	//MIP level whose texels are as wide as the cone of the ray: on a face at distance 1 an angle da moves the face
+	//coordinates by da / cos^2 of the angle off the face centre (ma / |direction|), over 2 units of resX texels
+	const SkyboxLevel& base = skybox_levels[img_side][0];
+	float cos_c = ma / r.direction.length();
+	float footprint = r.spread * MAX(base.resX, base.resY) / (2.0f * cos_c * cos_c);
+	if (footprint <= 1.0f)
+		return SkyboxBilinear(img_side, 0, s, t);
+
+	float lod = MIN(log2f(footprint), (float)(skybox_num_levels[img_side] - 1));
+	int level = (int)lod;
+	float f = lod - level;
+	if (f == 0.0f)
+		return SkyboxBilinear(img_side, level, s, t);
+	return SkyboxBilinear(img_side, level, s, t) * (1.0f - f) + SkyboxBilinear(img_side, level + 1, s, t) * f;
+}
 
-	return(Color(red, green, blue));
+//Bilinear interpolation of the texels of a MIP level around the face coordinates (s, t) in [0, 1], clamped to the face
+Color Scene::SkyboxBilinear(int face, int level, float s, float t) const
+{
+	const SkyboxLevel& l = skybox_levels[face][level];
+
+	float x = s * l.resX - 0.5f;
+	float y = t * l.resY - 0.5f;
+	float fx = x - floorf(x);
+	float fy = y - floorf(y);
+	int x0 = (int)floorf(x), y0 = (int)floorf(y);
+	int x1 = MIN(x0 + 1, l.resX - 1), y1 = MIN(y0 + 1, l.resY - 1);
+	x0 = MIN(MAX(x0, 0), l.resX - 1);
+	y0 = MIN(MAX(y0, 0), l.resY - 1);
+
+	const float *row0 = &skybox_texels[l.offset + 3 * y0 * l.resX];
+	const float *row1 = &skybox_texels[l.offset + 3 * y1 * l.resX];
+	float c[3];
+	for (int i = 0; i < 3; i++) {
+		float top = row0[3 * x0 + i] * (1.0f - fx) + row0[3 * x1 + i] * fx;
+		float bottom = row1[3 * x0 + i] * (1.0f - fx) + row1[3 * x1 + i] * fx;
+		c[i] = top * (1.0f - fy) + bottom * fy;
+	}
+	return Color(c[0], c[1], c[2]);
 }
 
 
 
 
 ////////////////////////////////////////////////////////////////////////////////
-// P3F file parsing methods.
+// P3F file loading: see p3fParser.cpp
 //
-void next_token(ifstream& file, char *token, const char *name)
-{
-  file >> token;
-  if (strcmp(token, name))
-    cerr << "'" << name << "' expected.\n";
-}
-
 bool Scene::load_p3f(const char *name)
 {
-  const	int	lineSize = 1024;
-  string	cmd;
-  char		token	[256];
-  ifstream	file(name, ios::in);
-  Material *	material;
-
-  material = NULL;
-
-  if (file >> cmd)
-  {
-    while (true)
-    {
-      if (cmd == "accel") {  //Acceleration data structure
-		unsigned int accel_type; // type of acceleration data structure
-		file >> accel_type;
-		this->SetAccelStruct((accelerator)accel_type);
-	  }
-
-	  else if (cmd == "spp")    //samples per pixel
-	  {
-		  unsigned int spp; // number of samples per pixel 
-
-		  file >> spp;
-		  this->SetSamplesPerPixel(spp);
-	  }
-	  else if (cmd == "f")   //Material
-      {
-	    double Kd, Ks, Shine, T, ior;
-	    Color cd, cs;
-
-	    file >> cd >> Kd >> cs >> Ks >> Shine >> T >> ior;
-
-	    material = new Material(cd, Kd, cs, Ks, Shine, T, ior);
-      }
-
-      else if (cmd == "s")    //Sphere
-      {
-	     Vector center;
-    	 float radius;
-         Sphere* sphere;
-
-	    file >> center >> radius;
-        sphere = new Sphere(center,radius);
-	    if (material) sphere->SetMaterial(material);
-        this->addObject( (Object*) sphere);
-      }
-
-	  else if (cmd == "box")    //axis aligned box
-	  {
-		  Vector minpoint, maxpoint;
-		  aaBox	*box;
-
-		  file >> minpoint >> maxpoint;
-		  box = new aaBox(minpoint, maxpoint);
-		  if (material) box->SetMaterial(material);
-		  this->addObject((Object*)box);
-	  }
-	  else if (cmd == "p")  // Polygon: just accepts triangles for now
-      {
-		  Vector P0, P1, P2;
-		  Triangle* triangle;
-		  unsigned total_vertices;
-		  
-		  file >> total_vertices;
-		  if (total_vertices == 3)
-		  {
-			  file >> P0 >> P1 >> P2;
-			  triangle = new Triangle(P0, P1, P2);
-			  if (material) triangle->SetMaterial(material);
-			  this->addObject( (Object*) triangle);
-		  }
-		  else
-		  {
-			  cerr << "Unsupported number of vertices.\n";
-			  break;
-		  }
-      }
-      
-	  else if (cmd == "mesh") {
-		  unsigned total_vertices, total_faces;
-		  unsigned P0, P1, P2;
-		  Triangle* triangle;
-		  Vector* verticesArray, vertex;
-
-		  file >> total_vertices >> total_faces;
-		  verticesArray = (Vector*)malloc(total_vertices * sizeof(Vector));
-		  for (int i = 0; i < total_vertices; i++) {
-			  file >> vertex;
-			  verticesArray[i] = vertex;
-		  }
-		  for (int i = 0; i < total_faces; i++) {
-			  file >> P0 >> P1 >> P2;
-			  if (P0 > 0) {
-				  P0 -= 1;
-				  P1 -= 1;
-				  P2 -= 1;
-			  }
-			  else {
-				  P0 += total_vertices;
-				  P1 += total_vertices;
-				  P2 += total_vertices;
-			  }
-			  triangle = new Triangle(verticesArray[P0], verticesArray[P1], verticesArray[P2]); //vertex index start at 1
-			  if (material) triangle->SetMaterial(material);
-			  this->addObject((Object*)triangle);
-		  }
-
-	  }
-
-	  else if (cmd == "pl")  // General Plane
-	  {
-          Vector P0, P1, P2;
-		  Plane* plane;
-
-          file >> P0 >> P1 >> P2;
-          plane = new Plane(P0, P1, P2);
-	      if (material) plane->SetMaterial(material);
-          this->addObject( (Object*) plane);
-	  }
-
-      else if (cmd == "l")  // Need to check light color since by default is white
-      {
-	    Vector pos;
-        Color color;
-
-	    file >> pos >> color;
-	    
-	      this->addLight(new Light(pos, color));
-	    
-      }
-      else if (cmd == "v")
-      {
-	    Vector up, from, at;
-	    float fov, hither;
-	    int xres, yres;
-        Camera* camera;
-		float focal_ratio; //ratio beteween the focal distance and the viewplane distance
-		float aperture_ratio; // number of times to be multiplied by the size of a pixel
-
-	    next_token (file, token, "from");
-	    file >> from;
-
-	    next_token (file, token, "at");
-	    file >> at;
-
-	    next_token (file, token, "up");
-	    file >> up;
-
-	    next_token (file, token, "angle");
-	    file >> fov;
-
-	    next_token (file, token, "hither");
-	    file >> hither;
-
-	    next_token (file, token, "resolution");
-	    file >> xres >> yres;
-
-		next_token(file, token, "aperture");
-		file >> aperture_ratio;
-
-		next_token(file, token, "focal");
-		file >> focal_ratio;
-	    // Create Camera
-		camera = new Camera( from, at, up, fov, hither, 100.0*hither, xres, yres, aperture_ratio, focal_ratio);
-        this->SetCamera(camera);
-      }
-
-      else if (cmd == "bclr")   //Background color
-      {
-		Color bgcolor;
-		file >> bgcolor;
-		this->SetBackgroundColor(bgcolor);
-	  }
-	
-	  else if (cmd == "env")
-	  {
-		  file >> token;
-		  
-		  this->LoadSkybox(token);
-		  this->SetSkyBoxFlg(true);
-	  }
-      else if (cmd[0] == '#')
-      {
-	    file.ignore (lineSize, '\n');
-      }
-      else
-      {
-	    cerr << "unknown command '" << cmd << "'.\n";
-	    break;
-      }
-      if (!(file >> cmd))
-        break;
-    }
-  }
-
-  file.close();
-  return true;
-};
+	P3FParser parser(this);
+	return parser.Parse(name);
+}
 
 void Scene::create_random_scene() {
 	Camera* camera;
@@ -677,16 +560,15 @@ void Scene::create_random_scene() {
 	camera = new Camera(Vector(-5.312192, 4.456562, 11.963158), Vector(0.0, 0.0, 0), Vector(0.0, 1.0, 0.0), 45.0, 0.01, 10000.0, 800, 600, 0, 1.5f);
 	this->SetCamera(camera);
 
-	this->addLight(new Light(Vector(7, 10, -5), Color(1.0, 1.0, 1.0)));
-	this->addLight(new Light(Vector(-7, 10, -5), Color(1.0, 1.0, 1.0)));
-	this->addLight(new Light(Vector(0, 10, 7), Color(1.0, 1.0, 1.0)));
+	this->addLight(arena.lights.New(Light(Vector(7, 10, -5), Color(1.0, 1.0, 1.0))));
+	this->addLight(arena.lights.New(Light(Vector(-7, 10, -5), Color(1.0, 1.0, 1.0))));
+	this->addLight(arena.lights.New(Light(Vector(0, 10, 7), Color(1.0, 1.0, 1.0))));
 
-	material = new Material(Color(0.5, 0.5, 0.5), 1.0, Color(0.0, 0.0, 0.0), 0.0, 10, 0, 1);
+	material = arena.materials.New(Material(Color(0.5, 0.5, 0.5), 1.0, Color(0.0, 0.0, 0.0), 0.0, 10, 0, 1));
 
 
-	sphere = new Sphere(Vector(0.0, -1000, 0.0), 1000.0);
+	sphere = addSphere(Sphere(Vector(0.0, -1000, 0.0), 1000.0));
 	if (material) sphere->SetMaterial(material);
-	this->addObject((Object*)sphere);
 
 	for (int a = -5; a < 5; a++)
 		for (int b = -5; b < 5; b++) {
@@ -697,40 +579,34 @@ void Scene::create_random_scene() {
 
 			if ((center - Vector(4.0, 0.2, 0.0)).length() > 0.9) {
 				if (choose_mat < 0.4) {  //diffuse
-					material = new Material(Color(rand_double(), rand_double(), rand_double()), 1.0, Color(0.0, 0.0, 0.0), 0.0, 10, 0, 1);
-					sphere = new Sphere(center, 0.2);
+					material = arena.materials.New(Material(Color(rand_double(), rand_double(), rand_double()), 1.0, Color(0.0, 0.0, 0.0), 0.0, 10, 0, 1));
+					sphere = addSphere(Sphere(center, 0.2));
 					if (material) sphere->SetMaterial(material);
-					this->addObject((Object*)sphere);
 				}
 				else if (choose_mat < 0.9) {   //metal
-					material = new Material(Color(0.0, 0.0, 0.0), 0.0, Color(rand_double(0.5, 1), rand_double(0.5, 1), rand_double(0.5, 1)), 1.0, 220, 0, 1);
-					sphere = new Sphere(center, 0.2);
+					material = arena.materials.New(Material(Color(0.0, 0.0, 0.0), 0.0, Color(rand_double(0.5, 1), rand_double(0.5, 1), rand_double(0.5, 1)), 1.0, 220, 0, 1));
+					sphere = addSphere(Sphere(center, 0.2));
 					if (material) sphere->SetMaterial(material);
-					this->addObject((Object*)sphere);
 				}
 				else {   //glass 
-					material = new Material(Color(0.0, 0.0, 0.0), 0.0, Color(1.0, 1.0, 1.0), 0.7, 20, 1, 1.5);
-					sphere = new Sphere(center, 0.2);
+					material = arena.materials.New(Material(Color(0.0, 0.0, 0.0), 0.0, Color(1.0, 1.0, 1.0), 0.7, 20, 1, 1.5));
+					sphere = addSphere(Sphere(center, 0.2));
 					if (material) sphere->SetMaterial(material);
-					this->addObject((Object*)sphere);
 				}
 
 			}
 
 		}
 
-	material = new Material(Color(0.0, 0.0, 0.0), 0.0, Color(1.0, 1.0, 1.0), 0.7, 20, 1, 1.5);
-	sphere = new Sphere(Vector(0.0, 1.0, 0.0), 1.0);
+	material = arena.materials.New(Material(Color(0.0, 0.0, 0.0), 0.0, Color(1.0, 1.0, 1.0), 0.7, 20, 1, 1.5));
+	sphere = addSphere(Sphere(Vector(0.0, 1.0, 0.0), 1.0));
 	if (material) sphere->SetMaterial(material);
-	this->addObject((Object*)sphere);
 
-	material = new Material(Color(0.4, 0.2, 0.1), 0.9, Color(1.0, 1.0, 1.0), 0.1, 10, 0, 1.0);
-	sphere = new Sphere(Vector(-4.0, 1.0, 0.0), 1.0);
+	material = arena.materials.New(Material(Color(0.4, 0.2, 0.1), 0.9, Color(1.0, 1.0, 1.0), 0.1, 10, 0, 1.0));
+	sphere = addSphere(Sphere(Vector(-4.0, 1.0, 0.0), 1.0));
 	if (material) sphere->SetMaterial(material);
-	this->addObject((Object*)sphere);
 
-	material = new Material(Color(0.4, 0.2, 0.1), 0.0, Color(0.7, 0.6, 0.5), 1.0, 220, 0, 1.0);
-	sphere = new Sphere(Vector(4.0, 1.0, 0.0), 1.0);
+	material = arena.materials.New(Material(Color(0.4, 0.2, 0.1), 0.0, Color(0.7, 0.6, 0.5), 1.0, 220, 0, 1.0));
+	sphere = addSphere(Sphere(Vector(4.0, 1.0, 0.0), 1.0));
 	if (material) sphere->SetMaterial(material);
-	this->addObject((Object*)sphere);
 }
\ No newline at end of file
@@ -11,6 +11,8 @@ using namespace std;
 #include "vector.h"
 #include "ray.h"
 #include "boundingBox.h"
+#include "arena.h"
+#include "environment.h"
 
 //Type of acceleration structure
 typedef enum { NONE, GRID_ACC, BVH_ACC }  accelerator;
@@ -18,6 +20,8 @@ typedef enum { NONE, GRID_ACC, BVH_ACC }  accelerator;
 //Skybox images constant symbolics
 typedef enum { RIGHT, LEFT, TOP, BOTTOM, FRONT, BACK } CubeMap;
 
+#define SKYBOX_MAX_LEVELS 16	//MIP levels of a skybox face: up to 32768 texels wide
+
 class Material
 {
 public:
@@ -25,13 +29,13 @@ public:
 	Material() :
 		m_diffColor(Color(0.2f, 0.2f, 0.2f)), m_Diff( 0.2f ), m_specColor(Color(1.0f, 1.0f, 1.0f)), m_Spec( 0.8f ), m_Shine(20), m_Refl( 1.0f ), m_T( 0.0f ), m_RIndex( 1.0f ){};
 
-	Material (Color& c, float Kd, Color& cs, float Ks, float Shine, float T, float ior) {
+	Material (const Color& c, float Kd, const Color& cs, float Ks, float Shine, float T, float ior) {
 		m_diffColor = c; m_Diff = Kd; m_specColor = cs; m_Spec = Ks; m_Shine = Shine; m_Refl = Ks; m_T = T; m_RIndex = ior;
 	}
 
-	void SetDiffColor( Color& a_Color ) { m_diffColor = a_Color; }
+	void SetDiffColor( const Color& a_Color ) { m_diffColor = a_Color; }
 	Color GetDiffColor() { return m_diffColor; }
-	void SetSpecColor(Color& a_Color) { m_specColor = a_Color; }
+	void SetSpecColor(const Color& a_Color) { m_specColor = a_Color; }
 	Color GetSpecColor() { return m_specColor; }
 	void SetDiffuse( float a_Diff ) { m_Diff = a_Diff; }
 	void SetSpecular( float a_Spec ) { m_Spec = a_Spec; }
@@ -56,7 +60,7 @@ class Light
 {
 public:
 
-	Light( Vector& pos, Color& col ): position(pos), color(col) {};
+	Light( const Vector& pos, const Color& col ): position(pos), color(col) {};
 	
 	Vector position;
 	Color color;
@@ -68,6 +72,7 @@ public:
 
 	Material* GetMaterial() { return m_Material; }
 	void SetMaterial( Material *a_Mat ) { m_Material = a_Mat; }
+	//Only hits with r.tmin <= dist < r.tmax are reported, so a primitive beyond the current closest hit is rejected early
 	virtual bool intercepts( Ray& r, float& dist ) = 0;
 	virtual Vector getNormal( Vector point ) = 0;
 	virtual AABB GetBoundingBox() { return AABB(); }
@@ -85,8 +90,8 @@ protected:
   float 	 D;
 
 public:
-		 Plane		(Vector& PNc, float Dc);
-		 Plane		(Vector& P0, Vector& P1, Vector& P2);
+		 Plane		(const Vector& PNc, float Dc);
+		 Plane		(const Vector& P0, const Vector& P1, const Vector& P2);
 
 		 bool intercepts( Ray& r, float& dist );
          Vector getNormal(Vector point);
@@ -96,7 +101,7 @@ class Triangle : public Object
 {
 	
 public:
-	Triangle	(Vector& P0, Vector& P1, Vector& P2);
+	Triangle	(const Vector& P0, const Vector& P1, const Vector& P2);
 	bool intercepts( Ray& r, float& t);
 	Vector getNormal(Vector point);
 	AABB GetBoundingBox(void);
@@ -111,7 +116,7 @@ protected:
 class Sphere : public Object
 {
 public:
-	Sphere( Vector& a_center, float a_radius ) : 
+	Sphere( const Vector& a_center, float a_radius ) : 
 		center( a_center ), SqRadius( a_radius * a_radius ), 
 		radius( a_radius ) {};
 
@@ -127,7 +132,7 @@ private:
 class aaBox : public Object   //Axis aligned box: another geometric object
 {
 public:
-	aaBox(Vector& minPoint, Vector& maxPoint);
+	aaBox(const Vector& minPoint, const Vector& maxPoint);
 	AABB GetBoundingBox(void);
 	bool intercepts(Ray& r, float& t);
 	Vector getNormal(Vector point);
@@ -135,10 +140,51 @@ public:
 private:
 	Vector min;
 	Vector max;
+};
+
+class TriangleMesh;
+class MeshInstance;
+
+//Types of primitives, each one stored in its own array of the scene arena
+typedef enum { SPHERE_PRIM, TRIANGLE_PRIM, BOX_PRIM, PLANE_PRIM, MESH_PRIM, INSTANCE_PRIM } PrimType;
+
+//Compact reference to a primitive used by the accelerators: its type and index in the array of that type
+struct PrimRef
+{
+	PrimRef() : type(0), index(0) {}
+	PrimRef(PrimType a_type, unsigned int a_index) : type(a_type), index(a_index) {}
 
-	Vector Normal;
+	unsigned int type : 3;
+	unsigned int index : 29;
 };
 
+//Storage of everything a scene creates, grouped by type and released together with the scene
+class SceneArena
+{
+public:
+	SceneArena(void);
+	~SceneArena();
+
+	//Per type dispatch without virtual calls (defined in primitive.h)
+	inline Object* getObject(PrimRef p);
+	inline bool intercepts(PrimRef p, Ray& r, float& t);
+	inline Vector getNormal(PrimRef p, Vector point);
+	inline AABB GetBoundingBox(PrimRef p);
+	inline bool Closest(Ray& r, PrimRef& hit_prim, float& t);  //closest hit over all the primitives, r.tmax ends at it
+	inline bool Occluded(Ray& r, PrimRef* occluder = NULL);  //any hit inside the ray interval, which occluder gets
+	inline bool ClosestIn(const vector<PrimRef>& list, Ray& r, PrimRef& hit_prim);  //same, over a list of references
+	inline bool OccludedIn(const vector<PrimRef>& list, Ray& r, PrimRef* occluder = NULL);
+
+	Arena<Sphere> spheres;
+	Arena<Triangle> triangles;
+	Arena<aaBox> boxes;
+	Arena<Plane> planes;
+	Arena<TriangleMesh> meshes;
+	Arena<TriangleMesh> prototypes;  //meshes only in the scene through their instances
+	Arena<MeshInstance> instances;
+	Arena<Material> materials;
+	Arena<Light> lights;
+};
 
 class Scene
 {
@@ -148,8 +194,9 @@ public:
 	
 	Camera* GetCamera() { return camera; }
 	Color GetBackgroundColor() { return bgColor; }
-	Color GetSkyboxColor(Ray& r);
+	Color GetSkyboxColor(const Ray& r);  //filtered over the cone of directions of r (its spread)
 	bool GetSkyBoxFlg() { return SkyBoxFlg; }
+	EnvironmentMap& GetEnvironment() { return environment; }  //loaded with an HDR file for 'env'
 	unsigned int GetSamplesPerPixel() { return samples_per_pixel; }
 	accelerator GetAccelStruct() { return accel_struc_type; }
 	
@@ -161,19 +208,36 @@ public:
 	void SetSamplesPerPixel(unsigned int spp) { samples_per_pixel = spp; }
 
 	int getNumObjects( );
-	void addObject( Object* o );
+	Sphere* addSphere( const Sphere& s );
+	Triangle* addTriangle( const Triangle& t );
+	aaBox* addBox( const aaBox& b );
+	Plane* addPlane( const Plane& p );
+	TriangleMesh* addMesh( void );
+	TriangleMesh* addPrototype( void );  //a mesh to be placed by instances, not a primitive itself
+	MeshInstance* addInstance( const MeshInstance& i );
+	void addAnimated( MeshInstance* i ) { animated.push_back(i); }  //an instance with keys
+	int getNumAnimated() { return animated.size(); }
+	void Animate( float time );  //moves the animated instances to their poses at time
 	Object* getObject( unsigned int index );
+	PrimRef getPrimitive( unsigned int index ) { return prims[index]; }
+	vector<PrimRef>& getPrimitives() { return prims; }  //bounded primitives, the ones the accelerators are built over
+	vector<PrimRef>& getUnboundedPrimitives() { return unbounded; }  //planes, tested linearly next to the accelerator
 	
 	int getNumLights( );
 	void addLight( Light* l );
 	Light* getLight( unsigned int index );
 
+	SceneArena& GetArena() { return arena; }
+
 	bool load_p3f(const char *name);  //Load NFF file method
 	void create_random_scene();
 	
 private:
-	vector<Object *> objects;
+	SceneArena arena;
+	vector<PrimRef> prims;
+	vector<PrimRef> unbounded;
 	vector<Light *> lights;
+	vector<MeshInstance *> animated;
 
 	Camera* camera;
 	Color bgColor;  //Background color
@@ -181,13 +245,19 @@ private:
 	accelerator accel_struc_type;
 
 	bool SkyBoxFlg = false;
-
-	struct {
-		ILubyte *img;
-		unsigned int resX;
-		unsigned int resY;
-		unsigned int BPP; //bytes per pixel
-	} skybox_img[6];
+	EnvironmentMap environment;
+
+	//Skybox faces as RGB float texels, each face followed by its MIP levels down to 1x1, all in one array
+	struct SkyboxLevel {
+		size_t offset;  //of the first texel in skybox_texels, in floats
+		int resX;
+		int resY;
+	};
+	vector<float> skybox_texels;
+	SkyboxLevel skybox_levels[6][SKYBOX_MAX_LEVELS];
+	int skybox_num_levels[6];
+
+	Color SkyboxBilinear(int face, int level, float s, float t) const;
 
 };
 
@@ -0,0 +1,106 @@
+#ifndef TRANSFORM_H
+#define TRANSFORM_H
+
+#include <cmath>
+
+#include "vector.h"
+#include "maths.h"
+
+//
+// Affine transform as the top 3 rows of a 4x4 matrix: the last column is the translation. Points get it, directions
+// only the 3x3 part, and normals the transpose of the 3x3 part of the inverse transform.
+//
+struct Transform
+{
+	float m[3][4];
+
+	static Transform Identity()
+	{
+		return Transform(1.0f, 0.0f, 0.0f, 0.0f, 0.0f, 1.0f, 0.0f, 0.0f, 0.0f, 0.0f, 1.0f, 0.0f);
+	}
+
+	Transform() = default;
+	Transform(float m00, float m01, float m02, float m03, float m10, float m11, float m12, float m13,
+		float m20, float m21, float m22, float m23)
+	{
+		m[0][0] = m00; m[0][1] = m01; m[0][2] = m02; m[0][3] = m03;
+		m[1][0] = m10; m[1][1] = m11; m[1][2] = m12; m[1][3] = m13;
+		m[2][0] = m20; m[2][1] = m21; m[2][2] = m22; m[2][3] = m23;
+	}
+
+	//Scaled by scale, turned about X, Y and Z in turn by the angles of rotation (degrees), then moved by translation
+	static Transform Pose(const Vector& translation, const Vector& rotation, float scale)
+	{
+		float cx = cosf(rotation.x * PI / 180.0f), sx = sinf(rotation.x * PI / 180.0f);
+		float cy = cosf(rotation.y * PI / 180.0f), sy = sinf(rotation.y * PI / 180.0f);
+		float cz = cosf(rotation.z * PI / 180.0f), sz = sinf(rotation.z * PI / 180.0f);
+
+		//Rz * Ry * Rx
+		return Transform(
+			scale * cz * cy, scale * (cz * sy * sx - sz * cx), scale * (cz * sy * cx + sz * sx), translation.x,
+			scale * sz * cy, scale * (sz * sy * sx + cz * cx), scale * (sz * sy * cx - cz * sx), translation.y,
+			scale * -sy, scale * cy * sx, scale * cy * cx, translation.z);
+	}
+
+	Transform operator*(const Transform& b) const  //b first, then this one
+	{
+		Transform c;
+		for (int i = 0; i < 3; i++) {
+			for (int j = 0; j < 4; j++)
+				c.m[i][j] = m[i][0] * b.m[0][j] + m[i][1] * b.m[1][j] + m[i][2] * b.m[2][j] + (j == 3 ? m[i][3] : 0.0f);
+		}
+		return c;
+	}
+
+	Vector Point(const Vector& p) const
+	{
+		return Vector(m[0][0] * p.x + m[0][1] * p.y + m[0][2] * p.z + m[0][3],
+			m[1][0] * p.x + m[1][1] * p.y + m[1][2] * p.z + m[1][3],
+			m[2][0] * p.x + m[2][1] * p.y + m[2][2] * p.z + m[2][3]);
+	}
+
+	Vector Direction(const Vector& d) const
+	{
+		return Vector(m[0][0] * d.x + m[0][1] * d.y + m[0][2] * d.z,
+			m[1][0] * d.x + m[1][1] * d.y + m[1][2] * d.z,
+			m[2][0] * d.x + m[2][1] * d.y + m[2][2] * d.z);
+	}
+
+	Vector Normal(const Vector& n) const  //of the inverse transform: the normal the transform itself gives
+	{
+		return Vector(m[0][0] * n.x + m[1][0] * n.y + m[2][0] * n.z,
+			m[0][1] * n.x + m[1][1] * n.y + m[2][1] * n.z,
+			m[0][2] * n.x + m[1][2] * n.y + m[2][2] * n.z);
+	}
+
+	float Determinant() const
+	{
+		return m[0][0] * (m[1][1] * m[2][2] - m[1][2] * m[2][1]) - m[0][1] * (m[1][0] * m[2][2] - m[1][2] * m[2][0]) +
+			m[0][2] * (m[1][0] * m[2][1] - m[1][1] * m[2][0]);
+	}
+
+	Transform Inverse() const  //of a transform with a non zero determinant
+	{
+		Transform inv;
+		float inv_det = 1.0f / Determinant();
+
+		inv.m[0][0] = (m[1][1] * m[2][2] - m[1][2] * m[2][1]) * inv_det;
+		inv.m[0][1] = (m[0][2] * m[2][1] - m[0][1] * m[2][2]) * inv_det;
+		inv.m[0][2] = (m[0][1] * m[1][2] - m[0][2] * m[1][1]) * inv_det;
+		inv.m[1][0] = (m[1][2] * m[2][0] - m[1][0] * m[2][2]) * inv_det;
+		inv.m[1][1] = (m[0][0] * m[2][2] - m[0][2] * m[2][0]) * inv_det;
+		inv.m[1][2] = (m[0][2] * m[1][0] - m[0][0] * m[1][2]) * inv_det;
+		inv.m[2][0] = (m[1][0] * m[2][1] - m[1][1] * m[2][0]) * inv_det;
+		inv.m[2][1] = (m[0][1] * m[2][0] - m[0][0] * m[2][1]) * inv_det;
+		inv.m[2][2] = (m[0][0] * m[1][1] - m[0][1] * m[1][0]) * inv_det;
+
+		//the translation taken back: -inverse(3x3) * t
+		Vector t = inv.Direction(Vector(m[0][3], m[1][3], m[2][3]));
+		inv.m[0][3] = -t.x;
+		inv.m[1][3] = -t.y;
+		inv.m[2][3] = -t.z;
+		return inv;
+	}
+};
+
+#endif
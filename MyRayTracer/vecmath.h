@@ -0,0 +1,42 @@
+#ifndef VECMATH_H
+#define VECMATH_H
+
+#include <cmath>
+
+//
+// Header-only float3 math shared by Vector and Color. Everything is inline (constexpr where
+// possible), so the operators are expanded in the calling code of every translation unit.
+// The component order of the expressions matches the old out-of-line Vector code, so results are
+// bit-identical.
+//
+
+struct float3
+{
+	float x, y, z;
+
+	float3() = default;
+	constexpr float3(float a_x, float a_y, float a_z) : x(a_x), y(a_y), z(a_z) {}
+};
+
+constexpr float3 operator+(const float3& a, const float3& b) { return float3(a.x + b.x, a.y + b.y, a.z + b.z); }
+constexpr float3 operator-(const float3& a, const float3& b) { return float3(a.x - b.x, a.y - b.y, a.z - b.z); }
+constexpr float3 operator-(const float3& a) { return float3(-a.x, -a.y, -a.z); }
+constexpr float3 operator*(const float3& a, float s) { return float3(a.x * s, a.y * s, a.z * s); }
+constexpr float3 operator*(float s, const float3& a) { return float3(a.x * s, a.y * s, a.z * s); }
+constexpr float3 operator/(const float3& a, float s) { return float3(a.x / s, a.y / s, a.z / s); }
+
+inline float3& operator+=(float3& a, const float3& b) { a.x += b.x; a.y += b.y; a.z += b.z; return a; }
+inline float3& operator-=(float3& a, const float3& b) { a.x -= b.x; a.y -= b.y; a.z -= b.z; return a; }
+inline float3& operator*=(float3& a, float s) { a.x *= s; a.y *= s; a.z *= s; return a; }
+
+constexpr float3 mul(const float3& a, const float3& b) { return float3(a.x * b.x, a.y * b.y, a.z * b.z); }  //component-wise
+constexpr float dot(const float3& a, const float3& b) { return a.x * b.x + a.y * b.y + a.z * b.z; }
+constexpr float3 cross(const float3& a, const float3& b) { return float3(a.y * b.z - a.z * b.y, a.z * b.x - a.x * b.z, a.x * b.y - a.y * b.x); }
+constexpr float3 vmin(const float3& a, const float3& b) { return float3(a.x < b.x ? a.x : b.x, a.y < b.y ? a.y : b.y, a.z < b.z ? a.z : b.z); }
+constexpr float3 vmax(const float3& a, const float3& b) { return float3(a.x > b.x ? a.x : b.x, a.y > b.y ? a.y : b.y, a.z > b.z ? a.z : b.z); }
+constexpr float component(const float3& a, int axis) { return (axis == 0) ? a.x : (axis == 1) ? a.y : a.z; }
+
+inline float length(const float3& a) { return sqrtf(dot(a, a)); }
+inline float3 normalize(const float3& a) { return a * (1.0f / length(a)); }
+
+#endif
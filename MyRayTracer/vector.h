@@ -6,38 +6,37 @@
 #include <cfloat>
 using namespace std;
 
-class Vector
+#include "vecmath.h"
+
+class Vector : public float3
 {
 public:
-	Vector(){};
-	Vector(float x, float y, float z);
-	Vector(const Vector& v);
-
-	float length();
-
-	float getAxisValue(int axis);
-
-	Vector&	normalize();
-	Vector operator=(const Vector& v);
-	Vector operator+( const Vector& v );
-	Vector operator-( const Vector& v );
-	Vector operator*( float f );
-	float  operator*(const Vector& v);   //inner product
-	Vector operator/( float f );
-	Vector operator%( const Vector& v); //external product
-	Vector&	operator-=	(const Vector& v);
-	Vector&	operator-=	(const float v);
-	Vector&	operator*=	(const float v);
-	Vector&	operator+=	(const float v);
-
-	float x;
-	float y;
-	float z;
+	Vector() = default;
+	constexpr Vector(float x, float y, float z) : float3(x, y, z) {}
+	constexpr Vector(const float3& v) : float3(v) {}
+
+	float length() const { return ::length(*this); }
+
+	constexpr float getAxisValue(int axis) const { return component(*this, axis); }
+
+	Vector&	normalize() { return *this = ::normalize(*this); }
+	constexpr Vector operator+(const Vector& v) const { return vec() + v; }
+	constexpr Vector operator-(const Vector& v) const { return vec() - v; }
+	constexpr Vector operator*(float f) const { return vec() * f; }
+	constexpr float  operator*(const Vector& v) const { return dot(*this, v); }   //inner product
+	constexpr Vector operator/(float f) const { return vec() / f; }
+	constexpr Vector operator%(const Vector& v) const { return cross(*this, v); } //external product
+	Vector&	operator-=	(const Vector& v) { x -= v.x; y -= v.y; z -= v.z; return *this; }
+	Vector&	operator-=	(const float v) { x -= v; y -= v; z -= v; return *this; }
+	Vector&	operator*=	(const float v) { x *= v; y *= v; z *= v; return *this; }
+	Vector&	operator+=	(const float v) { x += v; y += v; z += v; return *this; }
 
      friend inline
   istream&	operator >>	(istream& s, Vector& v)
 	{ return s >> v.x >> v.y >> v.z; }
-  
+
+private:
+	constexpr const float3& vec() const { return *this; }
 };
 
-#endif
\ No newline at end of file
+#endif